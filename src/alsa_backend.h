@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// --input alsa[:DEVICE]（ENABLE_ALSA のときだけ。snd-aloop の Loopback でも試せる）
+
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <alsa/asoundlib.h>
+
+#include "audio_backend.h"
+
+const size_t alsaPeriods = 8;  // ALSA のバッファはこの周期分（5.3ms）
+const char* const alsaDefaultDevice = "plughw:0";
+
+// ALSA の PCM を mmap で読む（周期ごとに起きて、バッファの中の音声をコピーせずにそのまま渡す）
+// 収録時刻は PCM のタイムスタンプ（CLOCK_MONOTONIC）から、その時点で読める量の分を引いたもの（ADC の遅延は含まない）
+class AlsaBackend : public AudioBackend {
+    AudioSink sink;
+    std::string device;
+    snd_pcm_t* pcm = nullptr;
+    snd_pcm_uframes_t period = audioPeriod, bufferSize = audioPeriod * alsaPeriods;
+    std::atomic<bool> stopping{false};
+
+    bool configure() {
+        snd_pcm_hw_params_t* hw;
+        snd_pcm_hw_params_alloca(&hw);
+        unsigned int rate = (unsigned int)sampleRate;
+        int err;
+        if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+            (err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+            (err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_FLOAT_LE)) < 0 ||
+            (err = snd_pcm_hw_params_set_channels(pcm, hw, 1)) < 0 ||
+            (err = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0)) < 0 ||
+            (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, nullptr)) < 0 ||
+            (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &bufferSize)) < 0 ||
+            (err = snd_pcm_hw_params(pcm, hw)) < 0) {
+            std::cerr << "ALSA " << device << " does not support mmap capture of mono float at " << rate << "Hz: " << snd_strerror(err) << std::endl;
+            return false;
+        }
+
+        snd_pcm_sw_params_t* sw;
+        snd_pcm_sw_params_alloca(&sw);
+        if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0 ||
+            (err = snd_pcm_sw_params_set_avail_min(pcm, sw, period)) < 0 ||
+            (err = snd_pcm_sw_params_set_tstamp_mode(pcm, sw, SND_PCM_TSTAMP_ENABLE)) < 0 ||
+            (err = snd_pcm_sw_params_set_tstamp_type(pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC)) < 0 ||
+            (err = snd_pcm_sw_params(pcm, sw)) < 0) {
+            std::cerr << "ALSA " << device << " software parameters failed: " << snd_strerror(err) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    explicit AlsaBackend(const char* pcmDevice) : device(pcmDevice) {}
+    ~AlsaBackend() override {
+        if (pcm)
+            snd_pcm_close(pcm);
+    }
+
+    const char* name() const override { return "alsa"; }
+
+    bool open(const AudioSink& audioSink) override {
+        sink = audioSink;
+        int err = snd_pcm_open(&pcm, device.c_str(), SND_PCM_STREAM_CAPTURE, 0);
+        if (err < 0) {
+            std::cerr << "Failed to open the ALSA device " << device << ": " << snd_strerror(err) << std::endl;
+            pcm = nullptr;
+            return false;
+        }
+        if (!configure() || (err = snd_pcm_prepare(pcm)) < 0) {
+            if (err < 0)
+                std::cerr << "ALSA " << device << " prepare failed: " << snd_strerror(err) << std::endl;
+            return false;
+        }
+        std::cout << "ALSA " << device << ": period " << period << ", buffer " << bufferSize << " samples" << std::endl;
+        if (sink.latency)
+            sink.latency(AudioLatency{1.0f, (float)bufferSize / period, (uint32_t)period, (uint32_t)bufferSize,
+                                      (uint64_t)(period * 1e9 / sampleRate), (uint64_t)(bufferSize * 1e9 / sampleRate)});
+        return true;
+    }
+
+    void run() override {
+        bool xrun = false;
+        snd_pcm_start(pcm);
+        while (!stopping.load(std::memory_order_relaxed)) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+            if (avail < 0) {
+                // あふれた（-EPIPE）か止まった（-ESTRPIPE）。読めなかった分は失われている
+                if (snd_pcm_recover(pcm, (int)avail, 1) < 0 || snd_pcm_start(pcm) < 0) {
+                    std::cerr << "ALSA " << device << " failed: " << snd_strerror((int)avail) << std::endl;
+                    break;
+                }
+                xrun = true;
+                continue;
+            }
+            if ((snd_pcm_uframes_t)avail < period) {
+                // stop に気付けるように、1周期を大きく超えては待たない
+                snd_pcm_wait(pcm, 100);
+                continue;
+            }
+
+            uint64_t callbackNs = monotonicNs();
+            snd_pcm_uframes_t stampAvail;
+            snd_htimestamp_t stamp;
+            uint64_t stampNs = 0;
+            if (snd_pcm_htimestamp(pcm, &stampAvail, &stamp) == 0 && (stamp.tv_sec || stamp.tv_nsec))
+                stampNs = stamp.tv_sec * 1000000000ull + stamp.tv_nsec;
+            else
+                stampAvail = avail;
+
+            // バッファの終わりで折り返すので、mmap_begin は続いている分しか返さない
+            snd_pcm_uframes_t remaining = avail;
+            while (remaining > 0) {
+                const snd_pcm_channel_area_t* areas;
+                snd_pcm_uframes_t offset, frames = remaining;
+                int err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+                if (err < 0 || frames == 0)
+                    break;
+                const float* samples = (const float*)((const uint8_t*)areas[0].addr + areas[0].first / 8) + offset;
+                remaining -= frames;
+                // タイムスタンプの時点で読めた量のうち、このブロックより後ろにある分だけ前に収録された
+                uint64_t captureNs = 0;
+                if (stampNs) {
+                    snd_pcm_uframes_t consumed = avail - remaining;
+                    uint64_t laterNs = (uint64_t)(stampAvail > consumed ? stampAvail - consumed : 0) * 1000000000ull / (uint64_t)sampleRate;
+                    captureNs = stampNs > laterNs ? stampNs - laterNs : 0;
+                }
+                sink.process(AudioBlock{samples, frames, callbackNs, captureNs, xrun});
+                xrun = false;
+                snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, frames);
+                if (committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+                    xrun = true;
+                    break;
+                }
+            }
+        }
+        snd_pcm_drop(pcm);
+    }
+
+    void stop() override { stopping.store(true, std::memory_order_relaxed); }
+};
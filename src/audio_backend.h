@@ -0,0 +1,188 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// 音声の入力元（--input）。どれも音声のスレッドで open してから run し、届いた音声を AudioSink::process に渡す
+// ここにあるのはライブラリの要らないもの（PipeWire は pipewire_backend.h、ALSA は alsa_backend.h）
+// synthetic:       決まった合成音声（ゆっくり上下するピッチにビブラート、2秒ごとに 0.4秒の無音）を実時間に合わせて出す
+// file:PATH        録音（raw 32bit float、モノラル、48000Hz、- で標準入力）を実時間に合わせて読む（終わったら止まる）
+// PipeWire のないマシンやコンテナ、テストでも同じ処理を動かせて、コールバックの処理時間と遅延をバックエンドごとに比べられる
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <time.h>
+
+#include "pitch_detector.h"
+#include "chunk_capture.h"
+
+const size_t audioPeriod = 32; // 1回のコールバックのサンプル数（PipeWire には希望として伝え、ALSA と合成音声、ファイルはこの大きさで渡す）
+
+// 1回のコールバックで届いた音声
+struct AudioBlock {
+    const float* samples;
+    size_t numSamples;
+    uint64_t callbackNs; // コールバックが始まった時刻
+    uint64_t captureNs;  // 最後のサンプルを収録した時刻（分からなければ 0）
+    bool xrun;           // 前のブロックとの間の音声が失われた
+};
+
+// 入力元が報告する遅延（PipeWire の spa_latency_info と同じ並び。ALSA は周期とバッファの大きさ）
+struct AudioLatency {
+    float minQuantum, maxQuantum;
+    uint32_t minRate, maxRate;
+    uint64_t minNs, maxNs;
+};
+
+// バックエンドから処理側への呼び出し（process は音声のスレッドから、ほかは open か PipeWire のメインループから）
+struct AudioSink {
+    void (*process)(const AudioBlock& block) = nullptr;
+    void (*latency)(const AudioLatency& latency) = nullptr;
+    void (*paramChanged)(uint32_t id) = nullptr; // PipeWire の param_changed（トレース用）
+};
+
+class AudioBackend {
+public:
+    virtual ~AudioBackend() {}
+    virtual const char* name() const = 0;
+    // 音声のスレッドで：接続する（時間のかかるものは GL の初期化と並行して進む）
+    virtual bool open(const AudioSink& sink) = 0;
+    // 音声のスレッドで：stop が呼ばれるまで（ファイルは終わるまで）sink.process を呼び続ける
+    virtual void run() = 0;
+    // ほかのスレッドから：run を抜けさせる（run の前や run が終わった後に呼んでもよい）
+    virtual void stop() = 0;
+};
+
+// 実時間に合わせて待つ（締め切りは通しのサンプル数から決めて、ずれが溜まらないようにする）
+// 遅れても音声は捨てずに続けて渡すので、遅れた分はそのまま収録からの遅延に出る
+class RealtimePacer {
+    uint64_t startNs = 0, samples = 0;
+
+public:
+    void start() {
+        startNs = monotonicNs();
+        samples = 0;
+    }
+
+    // numSamples 先の最後のサンプルが収録される時刻まで待って、その時刻を返す
+    uint64_t wait(size_t numSamples) {
+        samples += numSamples;
+        uint64_t dueNs = startNs + (uint64_t)(samples * 1e9 / sampleRate);
+        struct timespec due = {(time_t)(dueNs / 1000000000ull), (long)(dueNs % 1000000000ull)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, nullptr) == EINTR) {}
+        return dueNs;
+    }
+};
+
+// 決まった合成音声（--render-bench と同じ）。同じ位置からなら毎回同じサンプルを返す
+class SyntheticVoice {
+    uint64_t index = 0;
+    double phase = 0.0;
+
+public:
+    float next() {
+        double t = index++ / sampleRate;
+        double f0 = 220.0 * std::exp2(std::sin(2.0 * M_PI * 0.1 * t)) * (1.0 + 0.01 * std::sin(2.0 * M_PI * 5.5 * t));
+        phase += f0 / sampleRate;
+        float x = 0.0f;
+        if (std::fmod(t, 2.0) < 1.6) {
+            for (int k = 1; k <= 5; k++)
+                x += 0.1f * std::sin(2.0 * M_PI * k * phase) / k;
+        }
+        return x;
+    }
+};
+
+class SyntheticBackend : public AudioBackend {
+    AudioSink sink;
+    SyntheticVoice voice;
+    std::atomic<bool> stopping{false};
+    float block[audioPeriod];
+
+public:
+    const char* name() const override { return "synthetic"; }
+
+    bool open(const AudioSink& audioSink) override {
+        sink = audioSink;
+        if (sink.latency)
+            sink.latency(AudioLatency{1.0f, 1.0f, (uint32_t)audioPeriod, (uint32_t)audioPeriod, 0, 0});
+        return true;
+    }
+
+    void run() override {
+        RealtimePacer pacer;
+        pacer.start();
+        while (!stopping.load(std::memory_order_relaxed)) {
+            // 1ブロック分を先に作っておき、それが収録し終わる時刻に渡す
+            for (size_t i = 0; i < audioPeriod; i++)
+                block[i] = voice.next();
+            uint64_t captureNs = pacer.wait(audioPeriod);
+            sink.process(AudioBlock{block, audioPeriod, monotonicNs(), captureNs, false});
+        }
+    }
+
+    void stop() override { stopping.store(true, std::memory_order_relaxed); }
+};
+
+class FileBackend : public AudioBackend {
+    AudioSink sink;
+    std::string path;
+    FILE* in = nullptr;
+    std::atomic<bool> stopping{false};
+    float block[audioPeriod];
+
+public:
+    explicit FileBackend(const char* filePath) : path(filePath) {}
+    ~FileBackend() override {
+        if (in && in != stdin)
+            fclose(in);
+    }
+
+    const char* name() const override { return "file"; }
+
+    bool open(const AudioSink& audioSink) override {
+        sink = audioSink;
+        in = path == "-" ? stdin : fopen(path.c_str(), "rb");
+        if (!in) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (sink.latency)
+            sink.latency(AudioLatency{1.0f, 1.0f, (uint32_t)audioPeriod, (uint32_t)audioPeriod, 0, 0});
+        return true;
+    }
+
+    void run() override {
+        RealtimePacer pacer;
+        pacer.start();
+        while (!stopping.load(std::memory_order_relaxed)) {
+            size_t got = fread(block, sizeof(float), audioPeriod, in);
+            if (got > 0) {
+                uint64_t captureNs = pacer.wait(got);
+                sink.process(AudioBlock{block, got, monotonicNs(), captureNs, false});
+            }
+            if (got < audioPeriod) {
+                std::cout << "The audio input " << path << " has ended" << std::endl;
+                break;
+            }
+        }
+    }
+
+    void stop() override { stopping.store(true, std::memory_order_relaxed); }
+};
+
+// --input の値からライブラリの要らないバックエンドを作る（分からなければ nullptr）
+inline std::unique_ptr<AudioBackend> makeBasicAudioBackend(const std::string& spec) {
+    if (spec == "synthetic")
+        return std::make_unique<SyntheticBackend>();
+    if (spec.rfind("file:", 0) == 0 && spec.size() > 5)
+        return std::make_unique<FileBackend>(spec.c_str() + 5);
+    return nullptr;
+}
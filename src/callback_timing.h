@@ -0,0 +1,153 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// on_process の処理時間をタイムスタンプカウンタで測り、バッファの長さ（quantum）ごとのヒストグラムにする
+// 締め切りはバッファ1つ分の時間（48000Hz で 32 サンプルなら 667us）で、ヒストグラムはその 0〜200% を 2% 刻みで数える
+// 書き込むのは on_process だけで、relaxed な atomic の読み書きしかしない（割り当ても、システムコールも、ロック付きの命令もない）
+// 描画スレッド（T キーの表示）と終了時の表示は同時に読んでも良い（数の間で多少ずれることはある）
+
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "pitch_detector.h"
+#include "chunk_capture.h"
+
+const size_t timingQuanta = 8;  // 別々に数えるバッファの長さの種類（それより多ければ最後のものにまとめる）
+const size_t timingBins = 100;  // 締め切りの 0〜200% を 2% 刻み（これを超えたものは最後の区間）
+
+// タイムスタンプカウンタ（x86 以外では CLOCK_MONOTONIC の ns。どちらも vDSO なのでシステムコールにはならない）
+inline uint64_t readTimingTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonicNs();
+#endif
+}
+
+class CallbackTiming {
+public:
+    struct Quantum {
+        std::atomic<uint32_t> samples{0}; // バッファの長さ（0 ならまだ使っていない）
+        std::atomic<uint64_t> count{0}, misses{0}, worstTicks{0};
+        std::atomic<uint64_t> bins[timingBins + 1] = {};
+    };
+
+private:
+    alignas(64) Quantum quanta[timingQuanta];
+    double ticksPerNs = 1.0;
+    uint64_t calibrationNs = 0, calibrationTicks = 0;
+
+    // 単一の書き込み側なので、lock 付きの加算は使わない
+    static void increment(std::atomic<uint64_t>& counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+public:
+    // タイムスタンプカウンタの周波数を CLOCK_MONOTONIC と比べて求める（起動時に始め、PipeWire の接続を待っている間を測る）
+    // finishCalibration はリアルタイムのコールバックが始まる前に呼ぶ
+    void startCalibration() {
+        calibrationNs = monotonicNs();
+        calibrationTicks = readTimingTicks();
+    }
+
+    void finishCalibration() {
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t elapsed = monotonicNs() - calibrationNs;
+        if (elapsed < 5000000) // 短すぎると誤差が大きい
+            std::this_thread::sleep_for(std::chrono::nanoseconds(5000000 - elapsed));
+        ticksPerNs = double(readTimingTicks() - calibrationTicks) / double(monotonicNs() - calibrationNs);
+#endif
+    }
+
+    uint64_t begin() const { return readTimingTicks(); }
+
+    // numSamples のバッファの処理が終わったときに、begin の値を渡して呼ぶ（締め切りに対する処理時間の割合を返す）
+    double end(uint64_t startTicks, size_t numSamples) {
+        uint64_t ticks = readTimingTicks() - startTicks;
+        Quantum* q = &quanta[timingQuanta - 1];
+        for (size_t i = 0; i < timingQuanta; i++) {
+            uint32_t samples = quanta[i].samples.load(std::memory_order_relaxed);
+            if (samples == 0)
+                quanta[i].samples.store((uint32_t)numSamples, std::memory_order_relaxed);
+            if (samples == 0 || samples == numSamples) {
+                q = &quanta[i];
+                break;
+            }
+        }
+        double budgetTicks = numSamples * 1e9 / sampleRate * ticksPerNs;
+        increment(q->bins[std::min(timingBins, (size_t)(ticks * (timingBins / 2) / budgetTicks))]);
+        increment(q->count);
+        if (ticks > budgetTicks)
+            increment(q->misses);
+        if (ticks > q->worstTicks.load(std::memory_order_relaxed))
+            q->worstTicks.store(ticks, std::memory_order_relaxed);
+        return ticks / budgetTicks;
+    }
+
+    const Quantum& quantum(size_t i) const { return quanta[i]; }
+
+    // 最も多く来たバッファの長さ（なければ -1）
+    int busiest() const {
+        int best = -1;
+        for (size_t i = 0; i < timingQuanta; i++)
+            if (quanta[i].count.load(std::memory_order_relaxed) > 0 &&
+                (best < 0 || quanta[i].count.load(std::memory_order_relaxed) > quanta[best].count.load(std::memory_order_relaxed)))
+                best = i;
+        return best;
+    }
+
+    // 締め切りの時間（us）
+    static double budgetUs(const Quantum& q) { return q.samples.load(std::memory_order_relaxed) * 1e6 / sampleRate; }
+    double worstUs(const Quantum& q) const { return q.worstTicks.load(std::memory_order_relaxed) / ticksPerNs / 1000.0; }
+
+    // p 分位（0〜1）の処理時間（us、区間の上端。締め切りの 200% を超える区間なら最大値）
+    double percentileUs(const Quantum& q, double p) const {
+        uint64_t counts[timingBins + 1], n = 0;
+        for (size_t b = 0; b <= timingBins; b++)
+            n += counts[b] = q.bins[b].load(std::memory_order_relaxed);
+        if (n == 0)
+            return 0.0;
+        uint64_t rank = std::min(n - 1, (uint64_t)(p * n)), seen = 0;
+        for (size_t b = 0; b < timingBins; b++) {
+            seen += counts[b];
+            if (seen > rank)
+                return std::min(worstUs(q), (b + 1) * budgetUs(q) * 2.0 / timingBins);
+        }
+        return worstUs(q);
+    }
+
+    uint64_t misses() const {
+        uint64_t n = 0;
+        for (const Quantum& q : quanta)
+            n += q.misses.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    void print() const {
+        printf("Callback timing (%s %.2f GHz):\n",
+#if defined(__x86_64__) || defined(__i386__)
+               "TSC", ticksPerNs
+#else
+               "CLOCK_MONOTONIC", 1.0
+#endif
+        );
+        for (const Quantum& q : quanta) {
+            uint64_t count = q.count.load(std::memory_order_relaxed);
+            if (count == 0)
+                continue;
+            printf("  %4u samples (budget %7.1f us): %8lu callbacks, p50 %7.1f p99 %7.1f p99.9 %7.1f max %7.1f us, %lu deadline misses\n",
+                   q.samples.load(std::memory_order_relaxed), budgetUs(q), (unsigned long)count,
+                   percentileUs(q, 0.5), percentileUs(q, 0.99), percentileUs(q, 0.999), worstUs(q),
+                   (unsigned long)q.misses.load(std::memory_order_relaxed));
+        }
+    }
+};
@@ -0,0 +1,114 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// on_process に届いたバッファの大きさと時刻を音声と一緒に記録する（pitch_replay で再生する）
+//   <prefix>.f32    : 届いた音声そのもの（32bit float, モノラル, 48000Hz の raw）
+//   <prefix>.chunks : 1コールバック1行で "<CLOCK_MONOTONIC の ns> <サンプル数>"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <time.h>
+
+#include "spsc_ring.h"
+
+// 1回のコールバック
+struct ChunkRecord {
+    uint64_t timestampNs;
+    uint32_t numSamples;
+};
+
+inline uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 記録したバッファの並びを読み込む
+inline bool readChunkLog(const std::string& prefix, std::vector<ChunkRecord>& chunks, std::vector<float>& samples) {
+    std::ifstream log(prefix + ".chunks");
+    std::ifstream audio(prefix + ".f32", std::ios::binary);
+    if (!log || !audio)
+        return false;
+    ChunkRecord rec;
+    while (log >> rec.timestampNs >> rec.numSamples)
+        chunks.push_back(rec);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(audio)), std::istreambuf_iterator<char>());
+    samples.resize(bytes.size() / sizeof(float));
+    memcpy(samples.data(), bytes.data(), samples.size() * sizeof(float));
+    return true;
+}
+
+// on_process から push し、書き込み用のスレッドがファイルへ書き出す
+class ChunkCapture {
+    SpscRing<float, (1 << 19)> audioRing; // 約11秒分
+    SpscRing<ChunkRecord, 4096> chunkRing;
+    std::atomic<uint64_t> droppedChunks{0};
+    std::atomic<bool> running{false};
+    std::ofstream audioFile, chunkFile;
+    std::thread writer;
+
+    void drain() {
+        float samples[4096];
+        ChunkRecord chunks[256];
+        // 先に音声を書き出して、ログに載る範囲の音声が必ずファイルにあるようにする
+        size_t n;
+        while ((n = chunkRing.pop(chunks, 256)) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                for (size_t left = chunks[i].numSamples; left > 0;) {
+                    size_t got = audioRing.pop(samples, std::min(left, (size_t)4096));
+                    audioFile.write((const char*)samples, got * sizeof(float));
+                    left -= got;
+                }
+                chunkFile << chunks[i].timestampNs << " " << chunks[i].numSamples << "\n";
+            }
+        }
+    }
+
+public:
+    bool open(const std::string& prefix) {
+        audioFile.open(prefix + ".f32", std::ios::binary);
+        chunkFile.open(prefix + ".chunks");
+        if (!audioFile || !chunkFile)
+            return false;
+        running = true;
+        writer = std::thread([this]() {
+            while (running.load(std::memory_order_relaxed)) {
+                drain();
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            drain();
+        });
+        return true;
+    }
+
+    // リアルタイムスレッドから呼ぶ（割り当てもシステムコールもしない）
+    void push(uint64_t timestampNs, const float* samples, size_t numSamples) {
+        // 両方に入るときだけ、音声を入れてからバッファの情報を入れる（読み出し側はバッファの情報を見てから音声を取り出す）
+        if (audioRing.writable() < numSamples || chunkRing.writable() < 1) {
+            droppedChunks.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        audioRing.push(samples, numSamples);
+        chunkRing.push(ChunkRecord{timestampNs, (uint32_t)numSamples});
+    }
+
+    void close() {
+        if (!running)
+            return;
+        running = false;
+        writer.join();
+        audioFile.close();
+        chunkFile.close();
+        uint64_t dropped = droppedChunks.load();
+        if (dropped)
+            std::cerr << "Capture dropped " << dropped << " callbacks because the writer could not keep up!" << std::endl;
+    }
+};
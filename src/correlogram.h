@@ -0,0 +1,20 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// 自己相関の時間変化（コレログラム）の表示用
+// on_process が correlogramInterval サンプルごとに正規化した自己相関を TripleBuffer で渡し、描画側がテクスチャの行にする
+
+#include <cstddef>
+#include <cstdint>
+
+#include "pitch_detector.h"
+#include "pitch_history.h"
+
+const size_t correlogramInterval = 800; // 1行のサンプル数（60行/秒）
+const size_t correlogramRows = maxHistory / correlogramInterval; // 表示する行の数（履歴と同じ10秒分）
+
+struct CorrelogramFrame {
+    uint64_t sampleIndex; // この自己相関を取ったときの PitchDetector::sampleIndex
+    float correlation[lagMax - lagMin]; // PitchDetector::normalizedCorrelation
+};
@@ -0,0 +1,52 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// 時間（ミリ秒）の分布を固定の大きさのヒストグラムで集計する（長く動かしても領域は増えない）
+// 0〜200ms を 0.05ms 刻みで数え、それより長いものは最後の区間に入れる
+class DurationStats {
+    static const size_t bins = 4000;
+    static constexpr double binMs = 0.05;
+
+    std::array<uint64_t, bins> counts{};
+    uint64_t n = 0;
+    double sumMs = 0.0, maxMs = 0.0;
+
+public:
+    void add(double ms) {
+        size_t bin = ms <= 0.0 ? 0 : std::min(bins - 1, (size_t)(ms / binMs));
+        counts[bin]++;
+        n++;
+        sumMs += ms;
+        maxMs = std::max(maxMs, ms);
+    }
+
+    void reset() {
+        counts.fill(0);
+        n = 0;
+        sumMs = maxMs = 0.0;
+    }
+
+    uint64_t count() const { return n; }
+    double mean() const { return n ? sumMs / n : 0.0; }
+    double max() const { return maxMs; }
+
+    // p 分位（0〜1）の値（区間の上端、最後の区間なら最大値）
+    double percentile(double p) const {
+        if (n == 0)
+            return 0.0;
+        uint64_t rank = std::min(n - 1, (uint64_t)(p * n));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bins - 1; i++) {
+            seen += counts[i];
+            if (seen > rank)
+                return std::min(maxMs, (i + 1) * binMs);
+        }
+        return maxMs;
+    }
+};
@@ -0,0 +1,95 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// 声が入ってから線が画面に出るまでの時間（--latency）
+// on_process はバッファごとに、最後のサンプルの通し番号と、その収録時刻（PipeWire のグラフの時刻から遅延を引いたもの）、
+// コールバックの開始と処理の終了の時刻を印として送る。描画スレッドは印のサンプルまでを描いた最初のフレームで、
+// そのフレームのスワップが GPU で終わった時刻（タイムスタンプクエリ）を表示の時刻として、段階ごとの時間を数える
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include "spsc_ring.h"
+#include "frame_stats.h"
+
+struct LatencyMark {
+    uint64_t seqEnd;      // このバッファの最後のサンプルの次の通し番号（pitchRing.written()）
+    uint64_t captureNs;   // 最後のサンプルを収録した時刻
+    uint64_t callbackNs;  // on_process が始まった時刻
+    uint64_t processedNs; // ピッチをリングバッファへ書き終えた時刻
+};
+
+// 印が描かれたフレームの時刻
+struct LatencyFrame {
+    uint64_t startNs;     // 描画スレッドがピッチを読み始めた時刻
+    uint64_t swapNs;      // glfwSwapBuffers を呼んだ時刻
+    uint64_t presentNs;   // スワップが GPU で終わった時刻（CLOCK_MONOTONIC に直したもの）
+};
+
+class LatencyProbe {
+    SpscRing<LatencyMark, 4096> marks; // コールバック 4096 回分（32 サンプルのバッファで約2.7秒）
+    std::atomic<uint64_t> droppedMarks{0};
+    LatencyMark next;
+    bool hasNext = false;
+
+    // 収録から表示まで、収録からコールバック、処理、描画を待つ、描画、表示（スワップから GPU が終わるまで）
+    DurationStats total, captureToCallback, processing, waitForFrame, render, present;
+
+public:
+    // on_process から呼ぶ（待たない。描画が止まっていてあふれた印は捨てる）
+    void mark(const LatencyMark& m) {
+        if (!marks.push(m))
+            droppedMarks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 描画スレッド：履歴が historySeq サンプルまで進んだフレームで、そこまでのサンプルで終わる印をすべて取り出す
+    void take(uint64_t historySeq, std::vector<LatencyMark>& out) {
+        while (hasNext || marks.pop(&next, 1) == 1) {
+            hasNext = true;
+            if (next.seqEnd > historySeq)
+                return;
+            out.push_back(next);
+            hasNext = false;
+        }
+    }
+
+    // 描画スレッド：take で取り出した印が frame で表示された
+    void presented(const std::vector<LatencyMark>& drawn, const LatencyFrame& frame) {
+        for (const LatencyMark& m : drawn) {
+            auto ms = [](uint64_t from, uint64_t to) { return to > from ? (to - from) / 1e6 : 0.0; };
+            total.add(ms(m.captureNs, frame.presentNs));
+            captureToCallback.add(ms(m.captureNs, m.callbackNs));
+            processing.add(ms(m.callbackNs, m.processedNs));
+            waitForFrame.add(ms(m.processedNs, frame.startNs));
+            render.add(ms(std::max(m.processedNs, frame.startNs), frame.swapNs));
+            present.add(ms(frame.swapNs, frame.presentNs));
+        }
+    }
+
+    uint64_t count() const { return total.count(); }
+    double percentile(double p) const { return total.percentile(p); }
+
+    void print() const {
+        if (total.count() == 0) {
+            printf("Latency: no pitch was presented\n");
+            return;
+        }
+        printf("Latency from capture to display (%lu buffers): p50 %.2f p99 %.2f max %.2f ms\n",
+               (unsigned long)total.count(), total.percentile(0.5), total.percentile(0.99), total.max());
+        auto stage = [](const char* name, const DurationStats& s) {
+            printf("  %-20s p50 %7.2f p99 %7.2f max %7.2f ms\n", name, s.percentile(0.5), s.percentile(0.99), s.max());
+        };
+        stage("capture to callback", captureToCallback);
+        stage("processing", processing);
+        stage("wait for frame", waitForFrame);
+        stage("draw", render);
+        stage("swap to display", present);
+        uint64_t dropped = droppedMarks.load();
+        if (dropped)
+            printf("  %lu buffers were not measured because the renderer fell behind\n", (unsigned long)dropped);
+    }
+};
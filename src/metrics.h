@@ -0,0 +1,232 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// 動作状況の数値を UNIX ドメインソケットで Prometheus のテキスト形式で出す（--metrics PATH、画面のない設置先の監視用）
+// 繋いだら全部を書いて閉じる（socat -u UNIX-CONNECT:PATH - でそのまま読め、HTTP の GET を送れば HTTP で返すので
+// curl --unix-socket PATH http://localhost/metrics でも読める）
+// 値は各スレッドが relaxed な atomic に書くだけで、読んで整形するのはこのサーバーのスレッドだけなので、on_process は待たない
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "pitch_detector.h"
+#include "chunk_capture.h"
+#include "callback_timing.h"
+
+// 書き込み側はそれぞれの値につき1スレッドだけ（数は add で増やし、lock 付きの命令は使わない）
+struct PipelineMetrics {
+    // on_process
+    std::atomic<uint64_t> callbacks{0}, samples{0}, voicedSamples{0};
+    std::atomic<uint64_t> xruns{0}; // グラフの時刻がバッファの長さより進んでいた回数（その間の音声は来ていない）
+    std::atomic<uint32_t> degradationLevel{0};  // OverloadLadder のレベル（0 ならそのまま）
+    std::atomic<uint64_t> degradationSteps{0};  // レベルが変わった回数
+    // 描画スレッド
+    std::atomic<uint64_t> renderFrames{0};
+    std::atomic<uint64_t> droppedFrames{0};      // 前のフレームから 1.5 フレーム分以上空いたフレーム（無音で間引いているときは数えない）
+    std::atomic<uint64_t> overwrittenSamples{0}; // 描く前にリングバッファで上書きされたピッチ
+    std::atomic<float> renderFps{0.0f};          // 直近1秒
+    // on_param_changed（PipeWire のメインループ）
+    std::atomic<bool> latencyKnown{false};
+    std::atomic<float> latencyMinQuantum{0.0f}, latencyMaxQuantum{0.0f};
+    std::atomic<uint32_t> latencyMinRate{0}, latencyMaxRate{0};
+    std::atomic<uint64_t> latencyMinNs{0}, latencyMaxNs{0};
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+class MetricsServer {
+    const PipelineMetrics* metrics = nullptr;
+    const CallbackTiming* timing = nullptr;
+    std::string path;
+    int listenFd = -1;
+    std::atomic<bool> running{false};
+    std::thread server;
+
+    // 直近1秒の割合（サーバーのスレッドが1秒ごとに数の差から求める）
+    uint64_t rateNs = 0, rateCallbacks = 0, rateSamples = 0, rateVoiced = 0;
+    double callbacksPerSecond = 0.0, voicedRatio = 0.0;
+    uint64_t scrapes = 0;
+
+    void updateRates() {
+        uint64_t now = monotonicNs();
+        if (now - rateNs < 1000000000ull)
+            return;
+        uint64_t callbacks = metrics->callbacks.load(std::memory_order_relaxed);
+        uint64_t samples = metrics->samples.load(std::memory_order_relaxed);
+        uint64_t voiced = metrics->voicedSamples.load(std::memory_order_relaxed);
+        if (rateNs) {
+            callbacksPerSecond = (callbacks - rateCallbacks) * 1e9 / (now - rateNs);
+            voicedRatio = samples > rateSamples ? double(voiced - rateVoiced) / (samples - rateSamples) : 0.0;
+        }
+        rateNs = now;
+        rateCallbacks = callbacks;
+        rateSamples = samples;
+        rateVoiced = voiced;
+    }
+
+    static void describe(std::string& out, const char* name, const char* type, const char* help) {
+        out += std::string("# HELP pitch_visualizer_") + name + " " + help + "\n";
+        out += std::string("# TYPE pitch_visualizer_") + name + " " + type + "\n";
+    }
+
+    static void value(std::string& out, const char* name, const char* labels, double v) {
+        char line[256];
+        snprintf(line, sizeof(line), "pitch_visualizer_%s%s %.9g\n", name, labels, v);
+        out += line;
+    }
+
+    static void metric(std::string& out, const char* name, const char* type, const char* help, double v) {
+        describe(out, name, type, help);
+        value(out, name, "", v);
+    }
+
+    std::string format() {
+        auto load = [](const std::atomic<uint64_t>& counter) { return (double)counter.load(std::memory_order_relaxed); };
+        std::string out;
+        out.reserve(4096);
+        metric(out, "callbacks_total", "counter", "Audio callbacks processed.", load(metrics->callbacks));
+        metric(out, "callbacks_per_second", "gauge", "Audio callbacks in the last second.", callbacksPerSecond);
+        metric(out, "samples_total", "counter", "Audio samples processed.", load(metrics->samples));
+        metric(out, "voiced_samples_total", "counter", "Samples with a detected pitch.", load(metrics->voicedSamples));
+        metric(out, "voiced_ratio", "gauge", "Fraction of the samples of the last second with a detected pitch.", voicedRatio);
+        metric(out, "xruns_total", "counter", "Callbacks after which the graph clock had advanced by more than the buffer.", load(metrics->xruns));
+        metric(out, "degradation_level", "gauge", "Overload degradation level of the detector (0: full, 3: cheapest).",
+               metrics->degradationLevel.load(std::memory_order_relaxed));
+        metric(out, "degradation_steps_total", "counter", "Changes of the overload degradation level.", load(metrics->degradationSteps));
+
+        // on_process の処理時間はバッファの長さごと
+        describe(out, "callback_seconds", "gauge", "Audio callback processing time quantiles per buffer size.");
+        for (size_t i = 0; i < timingQuanta; i++) {
+            const CallbackTiming::Quantum& q = timing->quantum(i);
+            if (q.count.load(std::memory_order_relaxed) == 0)
+                continue;
+            char labels[64];
+            uint32_t samples = q.samples.load(std::memory_order_relaxed);
+            snprintf(labels, sizeof(labels), "{buffer=\"%u\",quantile=\"0.5\"}", samples);
+            value(out, "callback_seconds", labels, timing->percentileUs(q, 0.5) / 1e6);
+            snprintf(labels, sizeof(labels), "{buffer=\"%u\",quantile=\"0.99\"}", samples);
+            value(out, "callback_seconds", labels, timing->percentileUs(q, 0.99) / 1e6);
+            snprintf(labels, sizeof(labels), "{buffer=\"%u\",quantile=\"1\"}", samples);
+            value(out, "callback_seconds", labels, timing->worstUs(q) / 1e6);
+        }
+        metric(out, "callback_deadline_misses_total", "counter", "Audio callbacks that took longer than their buffer.", (double)timing->misses());
+
+        metric(out, "render_fps", "gauge", "Frames drawn in the last second.", metrics->renderFps.load(std::memory_order_relaxed));
+        metric(out, "render_frames_total", "counter", "Frames drawn.", load(metrics->renderFrames));
+        metric(out, "dropped_frames_total", "counter", "Frames that came more than 1.5 frame periods after the previous one.", load(metrics->droppedFrames));
+        metric(out, "overwritten_samples_total", "counter", "Pitch samples overwritten in the ring buffer before they were drawn.",
+               load(metrics->overwrittenSamples));
+
+        if (metrics->latencyKnown.load(std::memory_order_relaxed)) {
+            metric(out, "latency_min_quantum", "gauge", "PipeWire reported latency in quanta (min).", metrics->latencyMinQuantum.load(std::memory_order_relaxed));
+            metric(out, "latency_max_quantum", "gauge", "PipeWire reported latency in quanta (max).", metrics->latencyMaxQuantum.load(std::memory_order_relaxed));
+            metric(out, "latency_min_rate", "gauge", "PipeWire reported latency in samples (min).", metrics->latencyMinRate.load(std::memory_order_relaxed));
+            metric(out, "latency_max_rate", "gauge", "PipeWire reported latency in samples (max).", metrics->latencyMaxRate.load(std::memory_order_relaxed));
+            metric(out, "latency_min_seconds", "gauge", "PipeWire reported latency in time (min).", load(metrics->latencyMinNs) / 1e9);
+            metric(out, "latency_max_seconds", "gauge", "PipeWire reported latency in time (max).", load(metrics->latencyMaxNs) / 1e9);
+        }
+        return out;
+    }
+
+    // 50ms 以内に HTTP のリクエストが来れば HTTP で、来なければそのまま書く
+    void serve(int fd) {
+        struct timeval timeout = {1, 0}; // 読まない相手で止まらない
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        bool http = false;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 50) > 0) {
+            ssize_t n = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+            http = n >= 4 && memcmp(request, "GET ", 4) == 0;
+        }
+        std::string body = format();
+        std::string response;
+        if (http)
+            response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+        response += body;
+        for (size_t sent = 0; sent < response.size();) {
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        scrapes++;
+    }
+
+public:
+    ~MetricsServer() { close(); }
+
+    // 前に異常終了して残ったソケットがあれば作り直す（ソケット以外のファイルは消さない）
+    bool open(const char* socketPath, const PipelineMetrics& pipelineMetrics, const CallbackTiming& callbackTiming) {
+        metrics = &pipelineMetrics;
+        timing = &callbackTiming;
+        path = socketPath;
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                errno = EEXIST;
+                return false;
+            }
+            unlink(path.c_str());
+        }
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0)
+            return false;
+        if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 8) < 0) {
+            int err = errno;
+            ::close(listenFd);
+            listenFd = -1;
+            errno = err;
+            return false;
+        }
+
+        running = true;
+        server = std::thread([this]() {
+            while (running.load(std::memory_order_relaxed)) {
+                updateRates();
+                struct pollfd pfd = {listenFd, POLLIN, 0};
+                if (poll(&pfd, 1, 200) <= 0)
+                    continue;
+                int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0)
+                    continue;
+                updateRates();
+                serve(fd);
+                ::close(fd);
+            }
+        });
+        return true;
+    }
+
+    void close() {
+        if (!running)
+            return;
+        running = false;
+        server.join();
+        ::close(listenFd);
+        listenFd = -1;
+        unlink(path.c_str());
+        std::cerr << "Metrics were read " << scrapes << " times from " << path << std::endl;
+    }
+};
@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// on_process の負荷（処理時間 / バッファの長さ）を見て、検出器を段階的に軽くする（--no-degrade で無効）
+// レベル 0: そのまま、1: ピッチを 4 サンプルごとに求める（ピーク探索が 1/4）、2: さらに lagMax*2 幅の窓で確かめない（残りの探索が半分）、
+// 3: さらに一番低いオクターブ（55〜110Hz）の lag を更新も探索もしない（両方ほぼ半分）
+// 平滑化した負荷が overloadHighLoad を超えるか締め切りを過ぎたら1段下げ、overloadLowLoad 未満が2秒続いたら1段戻す
+// 3 から戻すときは、止めていた lag を1回のコールバックで overloadRestoreLags 個ずつ窓から計算し直す（1回で全部やると締め切りを過ぎる）
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+#include "pitch_detector.h"
+
+const int overloadLevels = 4;
+const double overloadHighLoad = 0.75;   // これを超えたら下げる
+const double overloadLowLoad = 0.2;     // 1段戻すと負荷は最大で3倍近く（レベル 1 から 0）になるので、戻しても overloadHighLoad を超えない値
+const double overloadSmoothing = 0.25;  // コールバックごとの負荷の指数移動平均の係数
+const uint64_t overloadHoldSamples = 12000;     // 下げてから 0.25秒は次を下げない（下げた効果が平均に出るまで）
+const uint64_t overloadRecoverSamples = 96000;  // 2秒続けて軽ければ戻す
+const size_t overloadHop = 4;
+const size_t overloadBandLags = lagMax / 2 - lagMin; // レベル 3 で更新する lag（110Hz 以上）
+const size_t overloadRestoreLags = 16;  // 1回で計算し直す lag（1つで lagMax*2 回の積和）
+
+// on_process だけが触る（表示とメトリクスには PipelineMetrics を通して出す）
+class OverloadLadder {
+    int level = 0;
+    double smoothedLoad = 0.0;
+    uint64_t sinceChange = 0, lowSamples = 0;
+    uint64_t stepsDown = 0, stepsUp = 0;
+    uint64_t levelSamples[overloadLevels] = {};
+
+public:
+    // on_process の始めに、検出器を今のレベルに合わせる
+    void apply(PitchDetector& d) const {
+        d.detectHop = level >= 1 ? overloadHop : 1;
+        d.verifyDouble = level < 2;
+        size_t lags = level >= 3 ? overloadBandLags : lagMax - lagMin;
+        if (d.activeLags > lags)
+            d.activeLags = lags;
+        else if (d.activeLags < lags)
+            d.restoreLags(std::min(overloadRestoreLags, lags - d.activeLags));
+    }
+
+    // on_process の終わりに、そのコールバックの負荷（1 で締め切りちょうど）を渡す。レベルが変わったら true
+    bool update(double load, size_t numSamples) {
+        smoothedLoad += (load - smoothedLoad) * overloadSmoothing;
+        sinceChange += numSamples;
+        levelSamples[level] += numSamples;
+        lowSamples = smoothedLoad < overloadLowLoad ? lowSamples + numSamples : 0;
+
+        if ((smoothedLoad > overloadHighLoad || load > 1.0) && level < overloadLevels - 1 && sinceChange >= overloadHoldSamples) {
+            level++;
+            stepsDown++;
+        } else if (lowSamples >= overloadRecoverSamples && level > 0) {
+            level--;
+            stepsUp++;
+        } else {
+            return false;
+        }
+        sinceChange = lowSamples = 0;
+        return true;
+    }
+
+    int currentLevel() const { return level; }
+
+    static const char* describe(int level) {
+        static const char* names[overloadLevels] = {"full", "hop 4", "hop 4, unverified", "hop 4, unverified, 110Hz and up"};
+        return names[level];
+    }
+
+    // 終了時に（on_process が止まってから）
+    void print() const {
+        uint64_t total = 0;
+        for (uint64_t n : levelSamples)
+            total += n;
+        if (total == 0)
+            return;
+        printf("Overload degradation: %lu steps down, %lu up, time per level:", (unsigned long)stepsDown, (unsigned long)stepsUp);
+        for (int i = 0; i < overloadLevels; i++)
+            printf(" %d (%s) %.1f%%", i, describe(i), 100.0 * levelSamples[i] / total);
+        printf("\n");
+    }
+};
@@ -0,0 +1,148 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// --input pipewire（ENABLE_PIPEWIRE のときだけ。あれば既定の入力）
+
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <pipewire/pipewire.h>
+#include <spa/param/format.h>
+#include <spa/param/audio/format-utils.h>
+#include <spa/param/audio/raw-utils.h>
+#include <spa/param/latency-utils.h>
+
+#include "audio_backend.h"
+
+// PipeWire のストリーム（入力方向、mono float の 48000Hz、1周期 audioPeriod を希望する）
+// ループとイベントはコンストラクタ（main のスレッド）で、コンテキストとストリームは open（音声のスレッド）で作る
+class PipeWireBackend : public AudioBackend {
+    AudioSink sink;
+    struct pw_main_loop* loop = nullptr;
+    struct pw_context* context = nullptr;
+    struct pw_stream* stream = nullptr;
+    struct spa_source* quitEvent = nullptr; // ループが回り始める前に送っても取りこぼさない終了の合図
+    struct pw_stream_events events;
+    uint64_t lastTicks = UINT64_MAX, expectedTicks = 0;
+
+    static void onQuit(void* data, [[maybe_unused]] uint64_t count) {
+        pw_main_loop_quit(((PipeWireBackend*)data)->loop);
+    }
+
+    static void onProcess(void* data) {
+        PipeWireBackend* self = (PipeWireBackend*)data;
+        uint64_t callbackNs = monotonicNs();
+        struct pw_buffer* buffer = pw_stream_dequeue_buffer(self->stream);
+        if (buffer == nullptr)
+            return;
+        if (buffer->buffer->n_datas > 0) {
+            struct spa_data* d = &buffer->buffer->datas[0];
+            if (d->data != nullptr && d->chunk != nullptr) {
+                size_t numSamples = d->chunk->size / sizeof(float); // 例えばnumSamples=940と941が交互に来る
+                const float* samples = (const float*)((uint8_t*)d->data + d->chunk->offset);
+
+                // グラフの時刻（グラフのレートのサンプル数）が前のバッファの長さより進んでいたら、その間のバッファは来ていない
+                // time.now はこのサイクルのグラフの時刻で、最後のサンプルはそこから time.delay（グラフのレートのサンプル数）前に収録された
+                bool xrun = false;
+                uint64_t captureNs = 0;
+                struct pw_time time;
+                if (pw_stream_get_time_n(self->stream, &time, sizeof(time)) == 0 && time.rate.denom > 0) {
+                    xrun = self->lastTicks != UINT64_MAX && time.ticks - self->lastTicks > self->expectedTicks + self->expectedTicks / 2;
+                    self->lastTicks = time.ticks;
+                    self->expectedTicks = (uint64_t)(numSamples * time.rate.denom / (time.rate.num * sampleRate));
+                    int64_t delayNs = std::max<int64_t>(time.delay, 0) * 1000000000ll * time.rate.num / time.rate.denom;
+                    captureNs = time.now > delayNs ? time.now - delayNs : 0;
+                }
+                if (numSamples > 0)
+                    self->sink.process(AudioBlock{samples, numSamples, callbackNs, captureNs, xrun});
+            }
+        }
+        pw_stream_queue_buffer(self->stream, buffer);
+    }
+
+    static void onParamChanged(void* data, uint32_t id, const struct spa_pod* params) {
+        PipeWireBackend* self = (PipeWireBackend*)data;
+        if (self->sink.paramChanged)
+            self->sink.paramChanged(id);
+        if (id != SPA_PARAM_Latency || params == nullptr)
+            return;
+        struct spa_latency_info latency;
+        int res = spa_latency_parse(params, &latency);
+        if (res < 0) {
+            fprintf(stderr, "Failed to parse latency info: %d\n", res);
+            return;
+        }
+        if (self->sink.latency)
+            self->sink.latency(AudioLatency{latency.min_quantum, latency.max_quantum, latency.min_rate, latency.max_rate, latency.min_ns, latency.max_ns});
+        // TODO: check "Pro Audio profile" or not
+    }
+
+public:
+    PipeWireBackend() {
+        // レイテンシを短くする
+        char quantum[32];
+        snprintf(quantum, sizeof(quantum), "%zu/%u", audioPeriod, (unsigned int)sampleRate);
+        setenv("PIPEWIRE_QUANTUM", quantum, true);
+        pw_init(nullptr, nullptr);
+        loop = pw_main_loop_new(nullptr);
+        quitEvent = pw_loop_add_event(pw_main_loop_get_loop(loop), onQuit, this);
+        memset(&events, 0, sizeof(events));
+        events.version = PW_VERSION_STREAM_EVENTS;
+        events.param_changed = onParamChanged;
+        events.process = onProcess;
+    }
+
+    ~PipeWireBackend() override {
+        if (stream)
+            pw_stream_destroy(stream);
+        if (context)
+            pw_context_destroy(context);
+        pw_main_loop_destroy(loop);
+        pw_deinit();
+    }
+
+    const char* name() const override { return "pipewire"; }
+
+    // コンテキストを作ってストリームを入力方向で接続する（デーモンとのやりとりで時間がかかる）
+    bool open(const AudioSink& audioSink) override {
+        sink = audioSink;
+        context = pw_context_new(pw_main_loop_get_loop(loop), nullptr, 0);
+        if (!context) {
+            std::cerr << "Pipewire context creation failed. exit." << std::endl;
+            return false;
+        }
+
+        // spa_pod_builder を用いて音声フォーマットのパラメータを生成
+        uint8_t podBuffer[1024];
+        struct spa_pod_builder builder;
+        spa_pod_builder_init(&builder, podBuffer, sizeof(podBuffer));
+
+        // spa_audio_info_raw に必要なパラメータをセット
+        struct spa_audio_info_raw info;
+        memset(&info, 0, sizeof(info));
+        info.format = SPA_AUDIO_FORMAT_F32;
+        info.rate = (size_t)sampleRate;
+        info.channels = 1;
+        const struct spa_pod* params = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info);
+
+        stream = pw_stream_new_simple(pw_main_loop_get_loop(loop), "Voice Pitch Visualizer", nullptr, &events, this);
+        if (!stream) {
+            std::cerr << "Pipewire stream generation failed. exit." << std::endl;
+            return false;
+        }
+        int res = pw_stream_connect(stream, PW_DIRECTION_INPUT, PW_ID_ANY,
+                                    (pw_stream_flags)(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS), &params, 1);
+        if (res < 0) {
+            std::cerr << "Pipewire stream connection failed. exit." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void run() override { pw_main_loop_run(loop); }
+
+    void stop() override { pw_loop_signal_event(pw_main_loop_get_loop(loop), quitEvent); }
+};
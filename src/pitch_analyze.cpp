@@ -0,0 +1,136 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+
+// 録音済みの音声（32bit float, モノラル, 48000Hz の raw）からピッチを一括で求めるオフライン解析ツール
+// ファイルを rebaseInterval ごとのチャンクに分け、各チャンクの直前 warmupSamples を窓に詰めてから全コアで並列に処理する。
+// 相関はチャンク境界で窓内のサンプルから計算し直すので、逐次処理と並列処理の結果はビット単位で一致する。
+
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "pitch_detector.h"
+
+// 入力全体（"-" なら標準入力）を読み込む
+static bool readSamples(const char* path, std::vector<float>& samples) {
+    std::istream* in = &std::cin;
+    std::ifstream file;
+    if (strcmp(path, "-") != 0) {
+        file.open(path, std::ios::binary);
+        if (!file)
+            return false;
+        in = &file;
+    }
+    std::vector<char> bytes((std::istreambuf_iterator<char>(*in)), std::istreambuf_iterator<char>());
+    samples.resize(bytes.size() / sizeof(float));
+    memcpy(samples.data(), bytes.data(), samples.size() * sizeof(float));
+    return true;
+}
+
+// [begin, end) のサンプルを処理して、output に (pitch, pitchExperiment) を交互に書き込む
+static void analyzeChunk(PitchDetector& det, const std::vector<float>& samples, size_t begin, size_t end, float* output) {
+    size_t warmup = begin < warmupSamples ? begin : warmupSamples;
+    det.prime(&samples[begin - warmup], warmup, begin);
+    for (size_t i = begin; i < end; i++)
+        det.processSample(samples[i], output[i*2 + 0], output[i*2 + 1]);
+}
+
+// チャンクをスレッドプールで処理する
+static void analyze(const std::vector<float>& samples, size_t chunkSamples, unsigned threads, float* output) {
+    size_t numChunks = (samples.size() + chunkSamples - 1) / chunkSamples;
+    std::atomic<size_t> nextChunk = 0;
+
+    auto worker = [&]() {
+        auto det = std::make_unique<PitchDetector>();
+        det->rebaseInterval = chunkSamples;
+        for (size_t c; (c = nextChunk.fetch_add(1, std::memory_order_relaxed)) < numChunks;) {
+            size_t begin = c * chunkSamples;
+            size_t end = std::min(begin + chunkSamples, samples.size());
+            analyzeChunk(*det, samples, begin, end, output);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool)
+        th.join();
+}
+
+static void usage() {
+    std::cerr << "Usage: pitch_analyze [-j threads] [-c chunk_samples] [-v] input.f32 [output.f32]" << std::endl
+              << "  input:  raw 32bit float, mono, 48000Hz (\"-\" for stdin)" << std::endl
+              << "  output: raw 32bit float pairs (pitch, experiment) per sample; y in 0..1, -1 for silence" << std::endl
+              << "  -v:     also run sequentially and check the results are bit-identical" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    unsigned threads = std::thread::hardware_concurrency();
+    size_t chunkSamples = 1 << 18; // 約5.5秒
+    bool verify = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:c:vh")) != -1) {
+        switch (opt) {
+            case 'j': threads = strtoul(optarg, nullptr, 10); break;
+            case 'c': chunkSamples = strtoull(optarg, nullptr, 10); break;
+            case 'v': verify = true; break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || threads == 0 || chunkSamples == 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    const char* inputPath = argv[optind];
+    const char* outputPath = optind + 1 < argc ? argv[optind + 1] : nullptr;
+
+    std::vector<float> samples;
+    if (!readSamples(inputPath, samples)) {
+        std::cerr << "Failed to open " << inputPath << ". exit." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<float> output(samples.size() * 2);
+    auto start = std::chrono::steady_clock::now();
+    analyze(samples, chunkSamples, threads, output.data());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cerr << samples.size() << " samples, " << threads << " threads: " << elapsed.count() << " s, "
+              << samples.size() / elapsed.count() << " samples/s ("
+              << samples.size() / sampleRate / elapsed.count() << "x realtime)" << std::endl;
+
+    if (verify) {
+        // 1つの検出器で先頭から最後まで通して処理する
+        std::vector<float> sequential(samples.size() * 2);
+        auto seqStart = std::chrono::steady_clock::now();
+        auto det = std::make_unique<PitchDetector>();
+        det->rebaseInterval = chunkSamples;
+        analyzeChunk(*det, samples, 0, samples.size(), sequential.data());
+        std::chrono::duration<double> seqElapsed = std::chrono::steady_clock::now() - seqStart;
+
+        bool same = memcmp(output.data(), sequential.data(), output.size() * sizeof(float)) == 0;
+        std::cerr << "sequential: " << seqElapsed.count() << " s, speedup " << seqElapsed.count() / elapsed.count()
+                  << "x, " << (same ? "bit-identical" : "MISMATCH") << std::endl;
+        if (!same)
+            return EXIT_FAILURE;
+    }
+
+    if (outputPath) {
+        std::ofstream out(outputPath, std::ios::binary);
+        out.write((const char*)output.data(), output.size() * sizeof(float));
+        if (!out) {
+            std::cerr << "Failed to write " << outputPath << ". exit." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
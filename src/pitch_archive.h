@@ -0,0 +1,255 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "pitch_history.h"
+
+// 長い練習を遡って見るための粗い履歴（GPU のリングにある最近の10秒より古いものも含む）
+// archiveBucketSamples サンプルごとに有声サンプルの y 座標の最小値と最大値と有声の割合をまとめ、
+// さらに archiveLevelFactor 区間ずつまとめた粗い段を archiveLevels 段まで重ねる（段 k の区間は archiveBucketSamples * 8^k サンプル）
+// 各段とも最近の区間はメモリのリングに、それより古いものはメモリマップした一時ファイルに置く
+// （ファイルのページはカーネルが必要なときだけ読み込むので、長く動かしても使うメモリは増えない）
+// 表示は列ごとに区間が1つ以上入る最も粗い段から作るので、1フレームの手間は列の数だけで決まり、表示する長さによらない
+const size_t archiveBucketSamples = 8 * historyBucketSamples; // 48000Hz で約10.7ms
+const size_t archiveLevelFactor = 8;
+const size_t archiveLevels = 7; // 最も粗い段の区間は約47分
+const size_t archiveRamBuckets = 5 * 60 * (size_t)sampleRate / archiveBucketSamples; // 段 0 は5分（段が上がるごとに半分の数で4倍の長さ）
+const size_t archiveFileGrowBuckets = 65536; // ファイルを伸ばす単位（段 0 で約12分）
+
+struct ArchiveBucket {
+    float minY, maxY; // 有声サンプルがなければ bucketEmptyMin, bucketEmptyMax
+    float voiced;     // 有声サンプルの割合（0〜1）
+};
+
+// 1つの段（同じ大きさの区間の並び）
+class ArchiveLevel {
+    std::vector<ArchiveBucket> ram;
+    uint64_t count = 0; // まとめ終えた区間の数（最も古い区間が 0）
+
+    // 追い出し先のファイル（区間 0 から spilled - 1 まで）。使えなくなったら、それより後に追い出すものは捨てる
+    int fd = -1;
+    ArchiveBucket* mapped = nullptr;
+    size_t mappedBuckets = 0;
+    uint64_t spilled = 0;
+
+    bool grow() {
+        size_t newBuckets = mappedBuckets + archiveFileGrowBuckets;
+        if (ftruncate(fd, newBuckets * sizeof(ArchiveBucket)) != 0)
+            return false;
+        void* p = mapped ? mremap(mapped, mappedBuckets * sizeof(ArchiveBucket), newBuckets * sizeof(ArchiveBucket), MREMAP_MAYMOVE)
+                         : mmap(nullptr, newBuckets * sizeof(ArchiveBucket), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            return false;
+        mapped = (ArchiveBucket*)p;
+        mappedBuckets = newBuckets;
+        return true;
+    }
+
+    void spill(const ArchiveBucket& bucket) {
+        if (fd < 0)
+            return;
+        if (spilled == mappedBuckets && !grow()) {
+            ::close(fd);
+            fd = -1;
+            return;
+        }
+        mapped[spilled++] = bucket;
+    }
+
+public:
+    // まとめている途中の区間（下の段のまとめている途中の区間は含まない）
+    PitchRange pending;
+    double pendingVoiced = 0.0; // 有声サンプルの数（段 0 では pending.voiced を使う）
+    uint64_t pendingSamples = 0;
+
+    explicit ArchiveLevel(size_t ramBuckets = archiveRamBuckets) : ram(ramBuckets) {}
+    ArchiveLevel(const ArchiveLevel&) = delete;
+    ArchiveLevel& operator=(const ArchiveLevel&) = delete;
+
+    ~ArchiveLevel() {
+        if (mapped)
+            munmap(mapped, mappedBuckets * sizeof(ArchiveBucket));
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    bool open(const char* dir) {
+        std::string path = std::string(dir) + "/pitch_visualizer.XXXXXX";
+        fd = mkstemp(path.data());
+        if (fd < 0)
+            return false;
+        unlink(path.c_str());
+        return true;
+    }
+
+    // まとめ終えた区間を最後に加える
+    void push(const ArchiveBucket& bucket) {
+        ArchiveBucket& slot = ram[count % ram.size()];
+        if (count >= ram.size())
+            spill(slot); // リングから押し出される区間
+        slot = bucket;
+        count++;
+    }
+
+    // まとめ終えた区間 i（捨てたものは空）
+    ArchiveBucket at(uint64_t i) const {
+        if (i < count && i + ram.size() >= count)
+            return ram[i % ram.size()];
+        if (i < spilled)
+            return mapped[i];
+        return {bucketEmptyMin, bucketEmptyMax, 0.0f};
+    }
+
+    uint64_t buckets() const { return count; }
+    uint64_t spilledBuckets() const { return spilled; }
+    size_t ramBuckets() const { return ram.size(); }
+    bool hasFile() const { return fd >= 0; }
+};
+
+class PitchArchive {
+    std::vector<std::unique_ptr<ArchiveLevel>> levels;
+
+    static uint64_t levelSamples(size_t level) {
+        uint64_t samples = archiveBucketSamples;
+        for (size_t k = 0; k < level; k++)
+            samples *= archiveLevelFactor;
+        return samples;
+    }
+
+    // 段 level の区間をまとめ終えて、上の段のまとめている途中の区間に加える
+    void finish(size_t level) {
+        ArchiveLevel& l = *levels[level];
+        double voiced = level == 0 ? (double)l.pending.voiced : l.pendingVoiced;
+        ArchiveBucket bucket = {l.pending.minY, l.pending.maxY, (float)(voiced / l.pendingSamples)};
+        l.push(bucket);
+        l.pending.clear();
+        l.pendingVoiced = 0.0;
+        l.pendingSamples = 0;
+        if (level + 1 == archiveLevels)
+            return;
+        ArchiveLevel& up = *levels[level + 1];
+        up.pending.merge(bucket.minY, bucket.maxY);
+        up.pendingVoiced += voiced;
+        up.pendingSamples += levelSamples(level);
+        if (up.pendingSamples == levelSamples(level + 1))
+            finish(level + 1);
+    }
+
+public:
+    PitchArchive() {
+        for (size_t k = 0; k < archiveLevels; k++)
+            levels.push_back(std::make_unique<ArchiveLevel>(std::max<size_t>(archiveRamBuckets >> k, 1024)));
+    }
+    PitchArchive(const PitchArchive&) = delete;
+    PitchArchive& operator=(const PitchArchive&) = delete;
+
+    // 追い出し先の一時ファイルを段ごとに dir に作る（作ってすぐに名前を消すので、終了すれば何も残らない）
+    // 失敗したときはメモリのリングの分だけを持つ
+    bool open(const char* dir) {
+        bool ok = true;
+        for (auto& level : levels)
+            ok = level->open(dir) && ok;
+        return ok;
+    }
+
+    // 続きのピッチ numSamples 個を区間にまとめる
+    void add(const float* pitch, size_t numSamples) {
+        ArchiveLevel& base = *levels[0];
+        for (size_t i = 0; i < numSamples; i++) {
+            base.pending.add(pitch[i]);
+            if (++base.pendingSamples == archiveBucketSamples)
+                finish(0);
+        }
+    }
+
+    // これまでにまとめたサンプルの数（まとめている途中のものも含む）
+    uint64_t samples() const { return levels[0]->buckets() * archiveBucketSamples + levels[0]->pendingSamples; }
+    uint64_t buckets() const { return levels[0]->buckets(); }
+    bool hasFile() const { return levels[0]->hasFile(); }
+
+    // すべての段の区間の数、メモリのリングの大きさ、ファイルへ追い出した区間の数
+    uint64_t allBuckets() const {
+        uint64_t n = 0;
+        for (auto& level : levels)
+            n += level->buckets();
+        return n;
+    }
+    size_t ramBuckets() const {
+        size_t n = 0;
+        for (auto& level : levels)
+            n += std::min<uint64_t>(level->buckets(), level->ramBuckets());
+        return n;
+    }
+    size_t ramCapacity() const {
+        size_t n = 0;
+        for (auto& level : levels)
+            n += level->ramBuckets();
+        return n;
+    }
+    uint64_t spilledBuckets() const {
+        uint64_t n = 0;
+        for (auto& level : levels)
+            n += level->spilledBuckets();
+        return n;
+    }
+
+    // 段 level の区間 i。まとめている途中の区間は下の段のまとめている途中の区間と合わせる。捨てたものとまだないものは空
+    ArchiveBucket at(size_t level, uint64_t i) const {
+        if (i < levels[level]->buckets())
+            return levels[level]->at(i);
+        if (i > levels[level]->buckets())
+            return {bucketEmptyMin, bucketEmptyMax, 0.0f};
+        PitchRange range;
+        double voiced = 0.0;
+        uint64_t samples = 0;
+        for (size_t k = 0; k <= level; k++) {
+            const ArchiveLevel& l = *levels[k];
+            range.merge(l.pending.minY, l.pending.maxY);
+            voiced += k == 0 ? (double)l.pending.voiced : l.pendingVoiced;
+            samples += l.pendingSamples;
+        }
+        return {range.minY, range.maxY, samples ? (float)(voiced / samples) : 0.0f};
+    }
+
+    // 通しのサンプル番号 [start, end) を columns 列に分けて、列ごとの (最小値, 最大値, 0, 有声の割合) を out に並べる
+    // 区間が列の幅の半分以下になる最も粗い段を使い、列には列の始まりから終わりまでにかかる区間をすべてまとめる
+    // （1列に読む区間は 2 * archiveLevelFactor 程度で、隣の列にはみ出して見えるのは半列まで）
+    void buildColumns(int64_t start, int64_t end, size_t columns, float* out) const {
+        double samplesPerColumn = (double)(end - start) / columns;
+        size_t level = 0;
+        while (level + 1 < archiveLevels && levelSamples(level + 1) * 2 <= samplesPerColumn)
+            level++;
+        uint64_t bucketSamples = levelSamples(level);
+        uint64_t count = levels[level]->buckets();
+        for (size_t c = 0; c < columns; c++) {
+            int64_t columnStart = start + (int64_t)(c * samplesPerColumn);
+            int64_t columnEnd = std::max(start + (int64_t)((c + 1) * samplesPerColumn), columnStart + 1);
+            PitchRange column;
+            float voiced = 0.0f;
+            size_t n = 0;
+            if (columnEnd > 0) {
+                uint64_t last = std::min<uint64_t>((columnEnd - 1) / bucketSamples, count);
+                for (uint64_t b = std::max<int64_t>(columnStart, 0) / bucketSamples; b <= last; b++, n++) {
+                    ArchiveBucket bucket = at(level, b);
+                    column.merge(bucket.minY, bucket.maxY);
+                    voiced += bucket.voiced;
+                }
+            }
+            out[c*4 + 0] = column.minY;
+            out[c*4 + 1] = column.maxY;
+            out[c*4 + 2] = 0.0f;
+            out[c*4 + 3] = n ? voiced / n : 0.0f;
+        }
+    }
+};
@@ -0,0 +1,346 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+
+// DSP と描画の内側のループのマイクロベンチマーク（make bench）
+// 入力は固定シードの合成信号なので、同じマシンなら毎回同じ処理を測ることになる。
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <sched.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "pitch_detector.h"
+#include "pitch_history.h"
+#include "pitch_archive.h"
+#include "overload_ladder.h"
+#include "audio_backend.h"
+
+// タイムスタンプカウンタ（x86 以外では 0 を返すので cyc の列は意味を持たない）
+static inline uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// 結果を捨てられないようにするための書き込み先
+volatile float sink;
+
+// 220Hz の声っぽい倍音に少しノイズを乗せた合成信号（固定シード）
+static std::vector<float> makeVoice(size_t count) {
+    std::vector<float> samples(count);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < count; i++) {
+        seed = seed * 1664525 + 1013904223;
+        float noise = (seed >> 8) / float(1 << 24) - 0.5f;
+        float phase = 2.0f * M_PI * 220.0f * i / sampleRate;
+        samples[i] = 0.3f * std::sin(phase) + 0.15f * std::sin(2 * phase) + 0.08f * std::sin(3 * phase) + 0.01f * noise;
+    }
+    return samples;
+}
+
+struct Result {
+    double mean, stddev, min; // ns/item
+    double cycles; // TSC cycles/item（最小値）
+};
+
+// body を runs 回実行して 1 回あたり items 個の処理にかかった時間を集計する
+static Result measure(int runs, size_t items, const std::function<void()>& body) {
+    body(); // ウォームアップ
+    std::vector<double> ns(runs), cycles(runs);
+    for (int r = 0; r < runs; r++) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t tscStart = readCycles();
+        body();
+        uint64_t tscEnd = readCycles();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        ns[r] = elapsed.count() / items;
+        cycles[r] = double(tscEnd - tscStart) / items;
+    }
+    Result res;
+    res.mean = 0.0;
+    for (double v : ns) res.mean += v;
+    res.mean /= runs;
+    double var = 0.0;
+    for (double v : ns) var += (v - res.mean) * (v - res.mean);
+    res.stddev = std::sqrt(var / runs);
+    res.min = *std::min_element(ns.begin(), ns.end());
+    res.cycles = *std::min_element(cycles.begin(), cycles.end());
+    return res;
+}
+
+// perItem: 1 項目あたりの値の単位, lags: 1 項目の中で回すラグの数（0 ならラグあたりの値は出さない）
+static void report(const char* name, const char* perItem, size_t lags, const Result& res) {
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+              << std::setw(12) << std::setprecision(2) << res.mean << " ns/" << std::left << std::setw(8) << perItem << std::right
+              << " +-" << std::setw(8) << std::setprecision(2) << res.stddev
+              << "  min " << std::setw(10) << std::setprecision(2) << res.min
+              << "  " << std::setw(10) << std::setprecision(1) << res.cycles << " cyc/" << std::left << std::setw(8) << perItem << std::right;
+    if (lags)
+        std::cout << "  " << std::setw(6) << std::setprecision(3) << res.cycles / lags << " cyc/lag";
+    std::cout << std::endl;
+}
+
+// 入力元ごとのコールバックの処理時間（検出器に通す時間）と、収録から処理し終わるまでの遅延
+struct BackendStats {
+    std::vector<double> costUs, latencyUs;
+    uint64_t samples = 0, xruns = 0;
+};
+static PitchDetector* backendDetector;
+static BackendStats* backendStats;
+
+static void benchProcess(const AudioBlock& block) {
+    float pitch = 0.0f, pitchExperiment = 0.0f;
+    uint64_t start = monotonicNs();
+    for (size_t i = 0; i < block.numSamples; i++)
+        backendDetector->processSample(block.samples[i], pitch, pitchExperiment);
+    sink = pitch + pitchExperiment;
+    uint64_t end = monotonicNs();
+    BackendStats& stats = *backendStats;
+    if (stats.costUs.size() < stats.costUs.capacity()) { // コールバックの中では確保しない
+        stats.costUs.push_back((end - start) / 1e3);
+        if (block.captureNs)
+            stats.latencyUs.push_back((end - std::min(block.captureNs, end)) / 1e3);
+    }
+    stats.samples += block.numSamples;
+    stats.xruns += block.xrun;
+}
+
+static double percentile(std::vector<double>& values, double p) {
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+// 入力元を seconds 秒動かして、1回のコールバックの処理時間と収録からの遅延を比べる
+static void benchBackend(const std::string& label, const std::string& spec, double seconds) {
+    std::unique_ptr<AudioBackend> backend = makeBasicAudioBackend(spec);
+    auto det = std::make_unique<PitchDetector>();
+    BackendStats stats;
+    stats.costUs.reserve((size_t)(seconds * sampleRate / 8) + 1024);
+    stats.latencyUs.reserve(stats.costUs.capacity());
+    backendDetector = det.get();
+    backendStats = &stats;
+
+    AudioSink audioSink;
+    audioSink.process = benchProcess;
+    std::atomic<bool> opened = false, done = false;
+    std::thread audioThread([&]() {
+        if (backend->open(audioSink)) {
+            opened = true;
+            backend->run();
+        }
+        done = true;
+    });
+    auto until = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (!done && std::chrono::steady_clock::now() < until)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    backend->stop();
+    audioThread.join();
+
+    std::cout << std::left << std::setw(28) << ("input " + label) << std::right << std::fixed;
+    if (!opened || stats.costUs.empty()) {
+        std::cout << (opened ? "no audio" : "unavailable") << std::endl;
+        return;
+    }
+    size_t callbacks = stats.costUs.size();
+    double blockUs = stats.samples * 1e6 / sampleRate / callbacks;
+    std::cout << std::setw(8) << callbacks << " callbacks of " << std::setw(6) << std::setprecision(1) << blockUs << " us"
+              << "  cost p50 " << std::setw(7) << std::setprecision(1) << percentile(stats.costUs, 0.5)
+              << " p99 " << std::setw(7) << percentile(stats.costUs, 0.99)
+              << " max " << std::setw(8) << percentile(stats.costUs, 1.0) << " us";
+    if (!stats.latencyUs.empty())
+        std::cout << "  latency p50 " << std::setw(7) << percentile(stats.latencyUs, 0.5)
+                  << " p99 " << std::setw(7) << percentile(stats.latencyUs, 0.99)
+                  << " max " << std::setw(8) << percentile(stats.latencyUs, 1.0) << " us";
+    std::cout << "  xruns " << stats.xruns << std::endl;
+}
+
+static void usage() {
+    std::cerr << "Usage: pitch_bench [-c cpu] [-r runs] [-s seconds]" << std::endl
+              << "  -s: seconds to run each audio input for the comparison (default 2, 0 to skip)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int cpu = 0;
+    int runs = 15;
+    double backendSeconds = 2.0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:s:h")) != -1) {
+        switch (opt) {
+            case 'c': cpu = atoi(optarg); break;
+            case 'r': runs = atoi(optarg); break;
+            case 's': backendSeconds = atof(optarg); break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (runs <= 0 || backendSeconds < 0.0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    // 測定中に別のコアへ移動しないように固定する
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        std::cerr << "sched_setaffinity failed: " << strerror(errno) << ", but continue anyway!" << std::endl;
+    else
+        std::cout << "Pinned to CPU " << cpu << std::endl;
+    std::cout << runs << " runs per kernel, cycles are TSC cycles (best run)" << std::endl << std::endl;
+
+    const size_t lags = lagMax - lagMin;
+    const size_t numSamples = (size_t)sampleRate / 4;
+    std::vector<float> voice = makeVoice(numSamples);
+
+    // 自己相関の逐次更新（1サンプルあたり）
+    auto det = std::make_unique<PitchDetector>();
+    report("correlation update", "sample", lags, measure(runs, numSamples, [&]() {
+        for (size_t i = 0; i < numSamples; i++)
+            det->updateCorrelation(voice[i]);
+    }));
+
+    // 最大値・閾値・放物線補間によるピーク探索（窓2つ分、1サンプルあたり）
+    std::vector<double> corr(det->lag_to_correlation, det->lag_to_correlation + lags);
+    std::vector<double> corrDouble(det->lag_to_correlation_double, det->lag_to_correlation_double + lags);
+    const size_t peakRepeat = 4096;
+    report("peak search (both windows)", "sample", lags * 2, measure(runs, peakRepeat, [&]() {
+        for (size_t i = 0; i < peakRepeat; i++)
+            sink = pickPeak(corr.data()) + pickPeak(corrDouble.data());
+    }));
+
+    // 検出処理全体（更新 + ピーク探索）
+    det->reset();
+    report("processSample (voiced)", "sample", lags, measure(runs, numSamples, [&]() {
+        float pitch, pitchExperiment;
+        for (size_t i = 0; i < numSamples; i++)
+            det->processSample(voice[i], pitch, pitchExperiment);
+        sink = pitch + pitchExperiment;
+    }));
+
+    // 負荷が高いときに on_process が使う軽いレベル（overload_ladder.h）
+    for (int level = 1; level < overloadLevels; level++) {
+        OverloadLadder ladder;
+        for (int i = 0; i < level; i++)
+            while (!ladder.update(1.5, overloadHoldSamples)) {}
+        det->reset();
+        det->activeLags = lags;
+        ladder.apply(*det);
+        std::string name = "processSample (level " + std::to_string(level) + ")";
+        report(name.c_str(), "sample", det->activeLags, measure(runs, numSamples, [&]() {
+            float pitch, pitchExperiment;
+            for (size_t i = 0; i < numSamples; i++)
+                det->processSample(voice[i], pitch, pitchExperiment);
+            sink = pitch + pitchExperiment;
+        }));
+    }
+    det->detectHop = 1;
+    det->verifyDouble = true;
+    det->activeLags = lags;
+
+    std::vector<float> silence(numSamples, 0.0f);
+    det->reset();
+    report("processSample (silence)", "sample", lags, measure(runs, numSamples, [&]() {
+        float pitch, pitchExperiment;
+        for (size_t i = 0; i < numSamples; i++)
+            det->processSample(silence[i], pitch, pitchExperiment);
+        sink = pitch + pitchExperiment;
+    }));
+
+    // lag から y 座標への変換（テーブル参照と log2 での計算）
+    const size_t lookups = 1 << 20;
+    std::vector<uint16_t> lagSeq(lookups);
+    uint32_t seed = 1;
+    for (auto& lag : lagSeq) {
+        seed = seed * 1664525 + 1013904223;
+        lag = lagMin + (seed >> 8) % lags;
+    }
+    report("lag_to_y table", "lookup", 0, measure(runs, lookups, [&]() {
+        float acc = 0.0f;
+        for (size_t i = 0; i < lookups; i++)
+            acc += lag_to_y[lagSeq[i] - lagMin];
+        sink = acc;
+    }));
+    report("lag_to_y log2", "lookup", 0, measure(runs, lookups, [&]() {
+        float acc = 0.0f;
+        for (size_t i = 0; i < lookups; i++)
+            acc += std::log2(sampleRate / lagSeq[i] / baseFrequency) / std::log2(maxDisplayPitch / baseFrequency);
+        sink = acc;
+    }));
+
+    // renderLoop の区間へのまとめ（1フレーム分 = 1/60秒のピッチ、1サンプルあたり）
+    const size_t frameSamples = (size_t)sampleRate / 60;
+    const size_t frames = 600;
+    std::vector<float> pitch(frameSamples * frames);
+    for (size_t i = 0; i < pitch.size(); i++)
+        pitch[i] = (i / 4800) % 2 ? -1.0f : lag_to_y[i % lags];
+    std::vector<float> filled(maxFilledBuckets * 2);
+    HistoryBucketWriter writer;
+    report("bucket fill", "sample", 0, measure(runs, frameSamples * frames, [&]() {
+        for (size_t f = 0; f < frames; f++) {
+            size_t firstBucket;
+            sink = writer.fill(pitch.data() + f * frameSamples, frameSamples, filled.data(), firstBucket);
+        }
+    }));
+
+    // 長い履歴（1時間分）の表示範囲を 1920 列にまとめる（1列あたり。表示する長さによらないこと）
+    {
+        PitchArchive archive;
+        archive.open(getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp");
+        for (size_t filledSamples = 0; filledSamples < 3600 * (size_t)sampleRate; filledSamples += pitch.size())
+            archive.add(pitch.data(), pitch.size());
+        const size_t columns = 1920;
+        std::vector<float> out(columns * 4);
+        for (double seconds : {60.0, 3600.0}) {
+            int64_t end = archive.samples();
+            int64_t start = end - (int64_t)(seconds * sampleRate);
+            std::string name = "archive columns (" + std::to_string((int)seconds) + " s)";
+            report(name.c_str(), "column", 0, measure(runs, columns * 100, [&]() {
+                for (int r = 0; r < 100; r++)
+                    archive.buildColumns(start, end, columns, out.data());
+                sink = out[0];
+            }));
+        }
+    }
+
+    // 入力元ごとの比較（同じ検出器に実時間で流す。遅延は収録から処理し終わるまでで、描画は含まない）
+    // ファイルは合成音声と同じものを一時ファイルに書いて読む
+    // PipeWire と ALSA はライブラリが要るのでここでは測らない（pitch_visualizer --input alsa --latency などの終了時の表示で同じ値を比べる）
+    if (backendSeconds > 0.0) {
+        std::cout << std::endl;
+        char filePath[] = "/tmp/pitch_bench_XXXXXX";
+        int fd = mkstemp(filePath);
+        if (fd >= 0) {
+            SyntheticVoice voice;
+            std::vector<float> audio((size_t)(backendSeconds * sampleRate) + sampleRate);
+            for (float& x : audio)
+                x = voice.next();
+            ssize_t written = write(fd, audio.data(), audio.size() * sizeof(float));
+            close(fd);
+            if (written != (ssize_t)(audio.size() * sizeof(float)))
+                std::cerr << "Failed to write " << filePath << std::endl;
+        }
+        benchBackend("synthetic", "synthetic", backendSeconds);
+        if (fd >= 0)
+            benchBackend("file", std::string("file:") + filePath, backendSeconds);
+        if (fd >= 0)
+            unlink(filePath);
+    }
+
+    return 0;
+}
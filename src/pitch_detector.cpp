@@ -0,0 +1,202 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#include "pitch_detector.h"
+
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+
+#include "lag_to_y.h"
+
+static double sqr(double x){
+    return x*x;
+}
+
+float pickPeak(const double* correlation, size_t lags) {
+    const size_t lagEnd = lagMin + lags;
+    float bestCorrelation = 0.0f;
+    for (size_t lag = lagMin; lag < lagEnd; lag++) {
+        float corr = correlation[lag - lagMin];
+        if (bestCorrelation < corr)
+            bestCorrelation = corr;
+    }
+
+    bool found = false;
+    float reBestCorrelation = 0.0, accurateBestCorrelation = 0.0;
+    float pitch = 0.0;
+    size_t reBestLag = 0;
+    for (size_t lag = lagMin; lag < lagEnd; lag++) {
+        float corr = correlation[lag - lagMin];
+        if (bestCorrelation * 0.8 < corr) {
+            found = true;
+            if (reBestCorrelation < corr) {
+                reBestCorrelation = corr;
+                reBestLag = lag;
+            }
+        } else if (found) {
+            if (reBestLag-1 >= lagMin && reBestLag+1 < lagEnd) {
+                // 二次曲線による補間
+                // x = (y2-y0) / (2*(2*y1 - y0 - y2))
+                // y = y1 + (y2-y0)**2 / (8 * (2*y1 - y0 - y2))
+                double y0 = correlation[reBestLag - lagMin - 1],
+                       y1 = corr,
+                       y2 = correlation[reBestLag - lagMin + 1];
+                float tAccurateBestCorrelation = y1 + sqr(y2-y0) / (8 * (2*y1 - y0 - y2));
+
+                if (accurateBestCorrelation < tAccurateBestCorrelation) {
+                    accurateBestCorrelation = tAccurateBestCorrelation;
+//                    newBestLag = reBestLag + (y2-y0) / (2*(2*y1 - y0 - y2));
+//                    pitch = log2(sampleRate / newBestLag / baseFrequency) / log2(maxDisplayPitch / baseFrequency);
+                    pitch = lag_to_y[reBestLag - lagMin]; // 横着する
+                }
+            }
+            found = false;
+            reBestCorrelation = FLT_MAX;
+        }
+    }
+    return pitch;
+}
+
+void PitchDetector::reset() {
+    memset(lag_to_correlation, 0, sizeof(lag_to_correlation));
+    memset(lag_to_correlation_double, 0, sizeof(lag_to_correlation_double));
+    memset(previousSamples, 0, sizeof(previousSamples));
+    previousSamplesDoubleRemovePos = 0;
+    previousSamplesRemovePos = lagMax;
+    previousSamplesAddPos = lagMax + lagMax;
+    rmsSQ = 0.0;
+    sampleIndex = 0;
+}
+
+void PitchDetector::prime(const float* history, size_t count, uint64_t startIndex) {
+    reset();
+    // サンプル番号 j は previousSamples[(j + lagMax*2) & mask] に置かれる
+    for (size_t i = 0; i < count; i++)
+        previousSamples[(startIndex - count + i + lagMax + lagMax) & previousSamplesMask] = history[i];
+    previousSamplesDoubleRemovePos = startIndex & previousSamplesMask;
+    previousSamplesRemovePos = (startIndex + lagMax) & previousSamplesMask;
+    previousSamplesAddPos = (startIndex + lagMax + lagMax) & previousSamplesMask;
+    sampleIndex = startIndex;
+    rebase();
+}
+
+// 窓内のサンプルから lag_to_correlation と lag_to_correlation_double の [first, last) を計算し直す
+static void rebaseLags(PitchDetector& d, size_t first, size_t last) {
+    // 直前に追加したサンプルの位置
+    size_t lastPos = (d.previousSamplesAddPos - 1) & previousSamplesMask;
+
+    for (size_t idx = first; idx < last; idx++) {
+        size_t lag = idx + lagMin;
+        double corr = 0.0, corrDouble = 0.0;
+        for (size_t k = 0; k < lagMax + lagMax; k++) {
+            double v = (double)d.previousSamples[(lastPos - k) & previousSamplesMask] * d.previousSamples[(lastPos - k - lag) & previousSamplesMask];
+            if (k < lagMax)
+                corr += v;
+            corrDouble += v;
+        }
+        d.lag_to_correlation[idx] = corr;
+        d.lag_to_correlation_double[idx] = corrDouble;
+    }
+}
+
+void PitchDetector::rebase() {
+    // 直前に追加したサンプルの位置
+    size_t lastPos = (previousSamplesAddPos - 1) & previousSamplesMask;
+
+    rmsSQ = 0.0;
+    for (size_t k = 0; k < lagMax; k++) {
+        double s = previousSamples[(lastPos - k) & previousSamplesMask];
+        rmsSQ += s * s;
+    }
+
+    rebaseLags(*this, 0, lagMax - lagMin);
+}
+
+void PitchDetector::restoreLags(size_t count) {
+    size_t last = std::min(activeLags + count, lagMax - lagMin);
+    rebaseLags(*this, activeLags, last);
+    activeLags = last;
+}
+
+void PitchDetector::updateCorrelation(float sample) {
+    if (rebaseInterval && sampleIndex % rebaseInterval == 0)
+        rebase();
+    sampleIndex++;
+
+    previousSamples[previousSamplesAddPos] = sample;
+    rmsSQ -= (double)previousSamples[previousSamplesRemovePos] * previousSamples[previousSamplesRemovePos];
+    rmsSQ += (double)previousSamples[previousSamplesAddPos] * previousSamples[previousSamplesAddPos];
+
+    size_t previousSampleRemoveLagPos = (previousSamplesRemovePos - lagMin) & previousSamplesMask;
+    size_t previousSampleRemoveDoubleLagPos = (previousSamplesDoubleRemovePos - lagMin) & previousSamplesMask;
+    size_t previousSampleAddLagPos = (previousSamplesAddPos - lagMin) & previousSamplesMask;
+
+    // RMS振幅の計算と自己相関法によるピッチ検出
+    const size_t lags = activeLags;
+    for (size_t idx = 0; idx < lags; idx++) {
+        lag_to_correlation[/*lag - lagMin*/idx] -= (double)previousSamples[previousSamplesRemovePos] * previousSamples[previousSampleRemoveLagPos];
+        lag_to_correlation_double[/*lag - lagMin*/idx] -= (double)previousSamples[previousSamplesDoubleRemovePos] * previousSamples[previousSampleRemoveDoubleLagPos];
+
+        lag_to_correlation[/*lag - lagMin*/idx] += (double)previousSamples[previousSamplesAddPos] * previousSamples[previousSampleAddLagPos];
+        lag_to_correlation_double[/*lag - lagMin*/idx] += (double)previousSamples[previousSamplesAddPos] * previousSamples[previousSampleAddLagPos];
+
+        previousSampleRemoveLagPos = (previousSampleRemoveLagPos - 1) & previousSamplesMask;
+        previousSampleRemoveDoubleLagPos = (previousSampleRemoveDoubleLagPos - 1) & previousSamplesMask;
+        previousSampleAddLagPos = (previousSampleAddLagPos - 1) & previousSamplesMask;
+    }
+
+    previousSamplesDoubleRemovePos = (previousSamplesDoubleRemovePos + 1) & previousSamplesMask;
+    previousSamplesRemovePos = (previousSamplesRemovePos + 1) & previousSamplesMask;
+    previousSamplesAddPos = (previousSamplesAddPos + 1) & previousSamplesMask;
+}
+
+void PitchDetector::detect(float& pitch, float& pitchExperiment) {
+    if (detectHop > 1 && sampleIndex % detectHop != 0) { // 間引いているときは前のピッチのまま
+        pitch = lastPitch;
+        pitchExperiment = lastPitchExperiment;
+        return;
+    }
+    if (rmsSQ < amplitudeThreshold * amplitudeThreshold * lagMax) { // 小さい音のピッチは無視して-1を返す
+        pitch = lastPitch = -1;
+        pitchExperiment = lastPitchExperiment = -1;
+        return;
+    }
+
+    // 有効な音はピッチの検出を最後まで進める
+    float newPitch = pickPeak(lag_to_correlation, activeLags);
+    pitchExperiment = lastPitchExperiment = newPitch;
+
+    float newPitch2 = newPitch;
+    if (verifyDouble) {
+        newPitch2 = pickPeak(lag_to_correlation_double, activeLags);
+        if (std::abs(newPitch - newPitch2) > 0.025) // 2つの窓で結果が食い違うものは捨てる
+            newPitch2 = -1.0f;
+    }
+    pitch = lastPitch = newPitch2;
+}
+
+void PitchDetector::normalizedCorrelation(float* out) const {
+    if (rmsSQ < amplitudeThreshold * amplitudeThreshold * lagMax) {
+        memset(out, 0, (lagMax - lagMin) * sizeof(float));
+        return;
+    }
+    double scale = 1.0 / rmsSQ;
+    for (size_t idx = 0; idx < activeLags; idx++)
+        out[idx] = lag_to_correlation[idx] * scale;
+    for (size_t idx = activeLags; idx < lagMax-lagMin; idx++) // 更新していない lag は 0
+        out[idx] = 0.0f;
+}
+
+float PitchDetector::confidence() const {
+    if (rmsSQ < amplitudeThreshold * amplitudeThreshold * lagMax)
+        return 0.0f;
+    double best = 0.0;
+    for (size_t idx = 0; idx < activeLags; idx++)
+        best = std::max(best, lag_to_correlation[idx]);
+    return best / rmsSQ;
+}
+
+void PitchDetector::processSample(float sample, float& pitch, float& pitchExperiment) {
+    updateCorrelation(sample);
+    detect(pitch, pitchExperiment);
+}
@@ -0,0 +1,89 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+
+// サンプリングレート（48000Hz固定）
+const float sampleRate = 48000.0f;
+
+// 表示用の上限ピッチ（Hz）
+const float maxDisplayPitch = 880.000f; // A6 の周波数
+
+// 表示用の下限ピッチ（Hz）
+const float baseFrequency = 55.0f; // A1 の周波数 (基準音)
+
+const size_t lagMin = ceil(sampleRate / maxDisplayPitch); // 54
+const size_t lagMax = floor(sampleRate / baseFrequency) + 1; // 873
+
+// 過去のサンプルを保持するためのリングバッファ
+const size_t previousSamplesBase = ceil(log2(lagMax + lagMax + lagMax));
+const size_t previousSamplesMax = 2 << previousSamplesBase; // 2**base
+const size_t previousSamplesMask = previousSamplesMax - 1;
+
+// 相関の状態を作り直すのに必要な過去のサンプル数（lagMax*2幅の窓をさらにlagMaxずらして参照する）
+const size_t warmupSamples = lagMax + lagMax + lagMax;
+
+const float amplitudeThreshold = 0.005f; // 小さな音の閾値
+
+// lag（lagMin..lagMax）から表示用の y 座標（0〜1）への変換テーブル（gen_table.cpp で生成）
+extern float lag_to_y[];
+
+// 自己相関の先頭 lags 個（lagMin から）のピークを探して表示用の y 座標を返す（見つからなければ 0）
+float pickPeak(const double* correlation, size_t lags = lagMax - lagMin);
+
+// Tiny delay dual-window autocorrelation によるピッチ検出器
+struct PitchDetector {
+    double lag_to_correlation[lagMax - lagMin]; // lagMax幅で取った自己相関
+    double lag_to_correlation_double[lagMax - lagMin]; // lagMax*2幅で取った自己相関
+
+    float previousSamples[previousSamplesMax]; // 55Hzのサンプルの2倍幅ずらしに対応
+    size_t previousSamplesDoubleRemovePos;
+    size_t previousSamplesRemovePos;
+    size_t previousSamplesAddPos;
+
+    double rmsSQ;
+
+    uint64_t sampleIndex; // 次に処理するサンプルの通し番号
+
+    // 0 以外なら sampleIndex がこの倍数になる度に相関を窓内のサンプルから計算し直す。
+    // 逐次更新の丸め誤差の履歴が消えるので、どこから処理を始めても同じ結果になる（オフライン解析用）
+    uint64_t rebaseInterval = 0;
+
+    // 負荷が高いときの間引き（既定はどれもしない。on_process では OverloadLadder が切り替える）
+    size_t detectHop = 1;                // ピッチはこのサンプル数ごとに求め、間は前のピッチを返す
+    bool verifyDouble = true;            // false なら lagMax*2 幅の窓で確かめず、検証前のピッチを返す
+    size_t activeLags = lagMax - lagMin; // 自己相関を更新してピークを探す lag の数（lagMin から、残りの lag は古いまま）
+    float lastPitch = -1.0f, lastPitchExperiment = -1.0f;
+
+    PitchDetector() { reset(); }
+
+    void reset();
+
+    // 1サンプル進めて、デュアルウィンドウで検証したピッチと検証前のピッチ（どちらも y 座標、無音は -1）を返す
+    void processSample(float sample, float& pitch, float& pitchExperiment);
+
+    // processSample の前半：サンプルを窓に追加して rmsSQ と自己相関を更新する
+    void updateCorrelation(float sample);
+
+    // processSample の後半：現在の自己相関からピッチを求める
+    void detect(float& pitch, float& pitchExperiment);
+
+    // startIndex から処理を始められるように、直前の history[0..count) を窓に詰める。
+    // count は warmupSamples 以上か、startIndex と等しくなければならない。startIndex は rebaseInterval の倍数であること
+    void prime(const float* history, size_t count, uint64_t startIndex);
+
+    // 窓内のサンプルから rmsSQ と自己相関を計算し直す
+    void rebase();
+
+    // activeLags の先の count 個の lag の自己相関を窓内のサンプルから計算し直し、更新の対象に戻す
+    void restoreLags(size_t count);
+
+    // lagMax幅で取った自己相関を rmsSQ で割ったもの（周期的なら 1 に近い、小さい音なら 0）を out[lag - lagMin] に書き込む
+    void normalizedCorrelation(float* out) const;
+
+    // lagMax幅で取った自己相関の最大値を rmsSQ で割ったもの（ピッチの確からしさ、小さい音なら 0）
+    float confidence() const;
+};
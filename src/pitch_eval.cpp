@@ -0,0 +1,342 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+
+// 基本周波数が分かっている合成音声でピッチ検出の精度と速度を評価し、保存済みの基準値より悪化していたら失敗する（make eval）
+// 閾値（bestCorrelation * 0.8 やデュアルウィンドウの 0.025 など）を変えたときの確認用。
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <unistd.h>
+
+#include "pitch_detector.h"
+
+// 1ケースの長さ
+const size_t caseSamples = 2 * (size_t)sampleRate;
+
+// 正解と比べる位置の遅れ（検出結果は窓の中央あたりのピッチになる。pitch は lagMax*2 幅、experiment は lagMax 幅の窓）
+const size_t pitchDelay = lagMax;
+const size_t experimentDelay = lagMax / 2;
+
+// 評価用の合成音声（f0 が 0 のサンプルは無声）
+struct TestCase {
+    std::string name;
+    std::vector<float> samples;
+    std::vector<float> f0;
+};
+
+// 乱数（固定シード）
+struct Random {
+    uint32_t seed;
+    float uniform() { // -0.5..0.5
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) / float(1 << 24) - 0.5f;
+    }
+};
+
+// f0 の軌跡 f0At(t) に沿った波形を作る（wave は位相 0..1 から振幅を返す）
+static TestCase makeTone(const std::string& name, const std::function<float(float)>& f0At, const std::function<float(double, double)>& wave, float amplitude) {
+    TestCase tc;
+    tc.name = name;
+    tc.samples.resize(caseSamples);
+    tc.f0.resize(caseSamples);
+    double phase = 0.0;
+    for (size_t i = 0; i < caseSamples; i++) {
+        float f0 = f0At(i / sampleRate);
+        tc.samples[i] = amplitude * wave(phase, f0 / sampleRate);
+        tc.f0[i] = f0;
+        phase += f0 / sampleRate;
+        phase -= std::floor(phase);
+    }
+    return tc;
+}
+
+// 正弦波
+static float sineWave(double phase, [[maybe_unused]] double dt) {
+    return std::sin(2.0 * M_PI * phase);
+}
+
+// 帯域制限したのこぎり波（PolyBLEP）
+static float sawWave(double phase, double dt) {
+    double v = 2.0 * phase - 1.0;
+    if (phase < dt) {
+        double t = phase / dt;
+        v -= t + t - t * t - 1.0;
+    } else if (phase > 1.0 - dt) {
+        double t = (phase - 1.0) / dt;
+        v -= t * t + t + t + 1.0;
+    }
+    return v;
+}
+
+// 指数スイープ（from から to まで caseSamples かけて上がる）
+static std::function<float(float)> sweep(float from, float to) {
+    float duration = caseSamples / sampleRate;
+    return [=](float t) { return from * std::pow(to / from, t / duration); };
+}
+
+// 声帯音源（のこぎり波）をフォルマント（2次の共振器3つ）に通した母音。f0 にビブラートをかける
+static TestCase makeVowel(const std::string& name, float f0Center, const float (&formants)[3], float vibratoCents, float vibratoRate) {
+    auto f0At = [=](float t) { return f0Center * std::pow(2.0f, vibratoCents / 1200.0f * std::sin(2.0f * M_PI * vibratoRate * t)); };
+    TestCase tc = makeTone(name, f0At, sawWave, 1.0f);
+
+    const float bandwidths[3] = {80.0f, 100.0f, 120.0f};
+    for (int k = 0; k < 3; k++) {
+        double r = std::exp(-M_PI * bandwidths[k] / sampleRate);
+        double a1 = 2.0 * r * std::cos(2.0 * M_PI * formants[k] / sampleRate), a2 = -r * r;
+        double y1 = 0.0, y2 = 0.0, peak = 0.0;
+        for (auto& s : tc.samples) {
+            double y = (1.0 - r) * s + a1 * y1 + a2 * y2;
+            y2 = y1;
+            y1 = y;
+            s = y;
+            peak = std::max(peak, std::abs(y));
+        }
+        for (auto& s : tc.samples)
+            s = s / peak * (k == 2 ? 0.3 : 1.0);
+    }
+    return tc;
+}
+
+static std::vector<TestCase> makeCorpus() {
+    std::vector<TestCase> corpus;
+    corpus.push_back(makeTone("sine_sweep", sweep(80.0f, 800.0f), sineWave, 0.3f));
+    corpus.push_back(makeTone("saw_sweep", sweep(80.0f, 800.0f), sawWave, 0.3f));
+
+    const float formantA[3] = {700.0f, 1220.0f, 2600.0f};
+    const float formantI[3] = {270.0f, 2290.0f, 3010.0f};
+    const float formantU[3] = {300.0f, 870.0f, 2240.0f};
+    corpus.push_back(makeVowel("vowel_a_110", 110.0f, formantA, 50.0f, 5.5f));
+    corpus.push_back(makeVowel("vowel_i_220", 220.0f, formantI, 50.0f, 5.5f));
+    corpus.push_back(makeVowel("vowel_u_440", 440.0f, formantU, 80.0f, 6.0f));
+
+    TestCase noise{"noise", std::vector<float>(caseSamples), std::vector<float>(caseSamples, 0.0f)};
+    Random rnd{4242};
+    for (auto& s : noise.samples)
+        s = 0.1f * rnd.uniform();
+    corpus.push_back(noise);
+
+    corpus.push_back(TestCase{"silence", std::vector<float>(caseSamples, 0.0f), std::vector<float>(caseSamples, 0.0f)});
+
+    // 無音から始まって途中で歌い出し、また黙る（有声・無声の切り替わり）
+    TestCase phrase = makeVowel("phrase_a_165", 165.0f, formantA, 40.0f, 5.0f);
+    for (size_t i = 0; i < caseSamples; i++) {
+        if (i < caseSamples / 4 || i >= caseSamples * 3 / 4) {
+            phrase.samples[i] = 0.0f;
+            phrase.f0[i] = 0.0f;
+        }
+    }
+    corpus.push_back(phrase);
+    return corpus;
+}
+
+// 1つのトラック（pitch か pitchExperiment）の評価値
+struct Metrics {
+    double grossError = 0.0; // 有声同士で 20% 以上ずれた割合
+    double centRms = 0.0; // 大きく外れたものを除いたずれ（セント）の二乗平均平方根
+    double voicingError = 0.0; // 有声・無声の判定を間違えた割合
+};
+
+// y 座標（0〜1）を周波数に戻す（無声は 0）
+static float yToFrequency(float y) {
+    if (y <= 0.0f)
+        return 0.0f;
+    return baseFrequency * std::pow(maxDisplayPitch / baseFrequency, y);
+}
+
+static Metrics evaluateTrack(const TestCase& tc, const std::vector<float>& track, size_t truthDelay) {
+    size_t voicedBoth = 0, gross = 0, fine = 0, voicingWrong = 0, frames = 0;
+    double centSq = 0.0;
+    for (size_t i = truthDelay; i < track.size(); i++) {
+        float truth = tc.f0[i - truthDelay];
+        float estimate = yToFrequency(track[i]);
+        frames++;
+        if ((truth > 0.0f) != (estimate > 0.0f)) {
+            voicingWrong++;
+            continue;
+        }
+        if (truth == 0.0f)
+            continue;
+        voicedBoth++;
+        if (std::abs(estimate - truth) > 0.2f * truth) {
+            gross++;
+            continue;
+        }
+        double cents = 1200.0 * std::log2(estimate / truth);
+        centSq += cents * cents;
+        fine++;
+    }
+    Metrics m;
+    m.grossError = voicedBoth ? double(gross) / voicedBoth : 0.0;
+    m.centRms = fine ? std::sqrt(centSq / fine) : 0.0;
+    m.voicingError = frames ? double(voicingWrong) / frames : 0.0;
+    return m;
+}
+
+// 悪化とみなすまでの許容幅（誤り率は絶対値、速度は比率）
+// 速度は基準値を書いたマシンでしか比べられないので、-t を付けたときだけ判定する
+const double grossErrorTolerance = 0.005;
+const double centRmsTolerance = 1.0;
+const double voicingErrorTolerance = 0.005;
+const double throughputTolerance = 0.5;
+
+static std::map<std::string, double> readBaselines(const char* path) {
+    std::map<std::string, double> baselines;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        std::string key;
+        double value;
+        if (fields >> key >> value)
+            baselines[key] = value;
+    }
+    return baselines;
+}
+
+static void usage() {
+    std::cerr << "Usage: pitch_eval [-b baselines.txt] [-u] [-t] [-w dir]" << std::endl
+              << "  -b: compare against baselines and fail on regression" << std::endl
+              << "  -u: write the current results to the baselines file" << std::endl
+              << "  -t: also fail when the throughput drops below half of the baseline (only meaningful on the machine that wrote it)" << std::endl
+              << "  -w: also write the corpus as raw 32bit float files into dir" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    const char* baselinePath = nullptr;
+    const char* corpusDir = nullptr;
+    bool update = false, gateThroughput = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:utw:h")) != -1) {
+        switch (opt) {
+            case 'b': baselinePath = optarg; break;
+            case 'u': update = true; break;
+            case 't': gateThroughput = true; break;
+            case 'w': corpusDir = optarg; break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (update && !baselinePath) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    std::vector<TestCase> corpus = makeCorpus();
+
+    if (corpusDir) {
+        for (const auto& tc : corpus) {
+            std::string path = std::string(corpusDir) + "/" + tc.name + ".f32";
+            std::ofstream out(path, std::ios::binary);
+            out.write((const char*)tc.samples.data(), tc.samples.size() * sizeof(float));
+            if (!out) {
+                std::cerr << "Failed to write " << path << ". exit." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // キーは "<case>.<track>.<metric>"
+    std::map<std::string, double> results;
+    size_t totalSamples = 0;
+    double totalSeconds = 0.0;
+
+    std::cout << std::left << std::setw(16) << "case" << std::setw(12) << "track" << std::right
+              << std::setw(10) << "gpe%" << std::setw(12) << "cent rms" << std::setw(12) << "voicing%" << std::endl;
+    auto det = std::make_unique<PitchDetector>();
+    for (const auto& tc : corpus) {
+        std::vector<float> pitch(tc.samples.size()), pitchExperiment(tc.samples.size());
+        det->reset();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < tc.samples.size(); i++)
+            det->processSample(tc.samples[i], pitch[i], pitchExperiment[i]);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        totalSamples += tc.samples.size();
+        totalSeconds += elapsed.count();
+
+        const std::tuple<const char*, const std::vector<float>*, size_t> tracks[] = {
+            {"pitch", &pitch, pitchDelay},
+            {"experiment", &pitchExperiment, experimentDelay},
+        };
+        for (const auto& [trackName, track, delay] : tracks) {
+            Metrics m = evaluateTrack(tc, *track, delay);
+            std::string key = tc.name + "." + trackName + ".";
+            results[key + "gross_error"] = m.grossError;
+            results[key + "cent_rms"] = m.centRms;
+            results[key + "voicing_error"] = m.voicingError;
+            std::cout << std::left << std::setw(16) << tc.name << std::setw(12) << trackName << std::right << std::fixed
+                      << std::setw(10) << std::setprecision(2) << m.grossError * 100
+                      << std::setw(12) << std::setprecision(2) << m.centRms
+                      << std::setw(12) << std::setprecision(2) << m.voicingError * 100 << std::endl;
+        }
+    }
+    double samplesPerSec = totalSamples / totalSeconds;
+    results["all.samples_per_sec"] = samplesPerSec;
+    std::cout << std::endl << "throughput: " << std::setprecision(0) << samplesPerSec << " samples/s ("
+              << std::setprecision(2) << samplesPerSec / sampleRate << "x realtime)" << std::endl;
+
+    if (update) {
+        std::ofstream out(baselinePath);
+        out << "# Generated by pitch_eval -u. <case>.<track>.<metric> <value>" << std::endl;
+        out << std::setprecision(9);
+        for (const auto& [key, value] : results)
+            out << key << " " << value << std::endl;
+        if (!out) {
+            std::cerr << "Failed to write " << baselinePath << ". exit." << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "Baselines written to " << baselinePath << std::endl;
+        return 0;
+    }
+
+    if (!baselinePath)
+        return 0;
+
+    std::map<std::string, double> baselines = readBaselines(baselinePath);
+    if (baselines.empty()) {
+        std::cerr << "No baselines in " << baselinePath << ". exit." << std::endl;
+        return EXIT_FAILURE;
+    }
+    int regressions = 0;
+    for (const auto& [key, value] : results) {
+        auto it = baselines.find(key);
+        if (it == baselines.end()) {
+            std::cerr << "missing baseline: " << key << std::endl;
+            regressions++;
+            continue;
+        }
+        double base = it->second;
+        bool regressed;
+        if (key.size() > 15 && key.compare(key.size() - 15, 15, "samples_per_sec") == 0)
+            regressed = gateThroughput && value < base * throughputTolerance;
+        else if (key.size() > 8 && key.compare(key.size() - 8, 8, "cent_rms") == 0)
+            regressed = value > base + centRmsTolerance;
+        else if (key.size() > 11 && key.compare(key.size() - 11, 11, "gross_error") == 0)
+            regressed = value > base + grossErrorTolerance;
+        else
+            regressed = value > base + voicingErrorTolerance;
+        if (regressed) {
+            std::cerr << std::setprecision(4) << "REGRESSION " << key << ": " << value << " (baseline " << base << ")" << std::endl;
+            regressions++;
+        }
+    }
+    if (regressions) {
+        std::cerr << regressions << " regression(s). fail." << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "No regressions against " << baselinePath << std::endl;
+    return 0;
+}
@@ -0,0 +1,84 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#include "pitch_detector.h"
+
+const size_t maxHistory = 10 * (size_t)sampleRate; // 表示するサンプルの数（10秒分）
+
+// ピッチのリングバッファの大きさ（2のべき乗で約5.5秒分。起動時にウインドウと GL の準備ができるまでのピッチもここに溜めておく）
+const size_t pitchRingSize = 1 << 18;
+
+// 描画スレッドがリングバッファから1回に読み出すピッチの数
+const size_t pitchBatchSamples = 16384;
+
+// 履歴は historyBucketSamples サンプルごとの区間にまとめ、区間ごとに有声サンプルの y 座標の最小値と最大値を持つ
+// （GPU 側のテクスチャバッファのリングに置き、新しい区間だけを送る）
+const size_t historyBucketSamples = 64; // 48000Hz で約1.3ms
+const size_t historyBuckets = maxHistory / historyBucketSamples;
+
+// 有声サンプルがない区間の最小値と最大値（最小値 > 最大値で空を表す）
+const float bucketEmptyMin = 2.0f;
+const float bucketEmptyMax = -2.0f;
+
+// 有声サンプルの y 座標の最小値と最大値をまとめる（履歴の区間、長い履歴の区間、スクロールした表示の列で共通）
+// サンプルから区間へは add、区間から列へは merge でまとめる（GPU のリングから列へは頂点シェーダーの columnRange が同じことをする）
+struct PitchRange {
+    float minY = bucketEmptyMin, maxY = bucketEmptyMax;
+    size_t voiced = 0; // add した有声サンプルの数
+
+    // ピッチ（0〜1、無声は -1）を1つ加える。y軸は 0Hz -> -1, maxDisplayPitch -> 1　の対数マッピング
+    void add(float pitch_y) {
+        if (pitch_y != -1.0f) {
+            minY = std::min(minY, pitch_y * 2.0f - 1.0f);
+            maxY = std::max(maxY, pitch_y * 2.0f - 1.0f);
+            voiced++;
+        }
+    }
+
+    // まとめ終えた区間の最小値と最大値を加える（空の区間は何も変えない）
+    void merge(float lo, float hi) {
+        minY = std::min(minY, lo);
+        maxY = std::max(maxY, hi);
+    }
+
+    void clear() { *this = PitchRange(); }
+};
+
+// 1回の fill で書き出す区間の最大数（pitchBatchSamples 分と、前回の書き込み中の区間と今回の書き込み中の区間）
+const size_t maxFilledBuckets = pitchBatchSamples / historyBucketSamples + 2;
+
+// ピッチを区間にまとめる
+class HistoryBucketWriter {
+public:
+    size_t bucket = 0; // 書き込み中の区間（最も新しい区間）
+    size_t filled = 0; // 書き込み中の区間に入ったサンプルの数
+    PitchRange range;  // 書き込み中の区間
+
+    // 続きのピッチ numSamples 個（pitchBatchSamples まで）を区間にまとめ、前回の書き込み中の区間から今回の書き込み中の区間までの
+    // 最小値と最大値を out に並べる（out には maxFilledBuckets 区間分が必要）
+    // 戻り値は out に書いた区間の数で、先頭の区間の番号は firstBucket に入る（番号は historyBuckets で折り返す）
+    size_t fill(const float* pitch, size_t numSamples, float* out, size_t& firstBucket) {
+        firstBucket = bucket;
+        size_t count = 0;
+        for (size_t i = 0; i < numSamples; i++) {
+            // 現在のピッチ値を取得（音量が小さい場合、-1が格納されている）
+            range.add(pitch[i]);
+            if (++filled == historyBucketSamples) {
+                out[count*2 + 0] = range.minY;
+                out[count*2 + 1] = range.maxY;
+                count++;
+                bucket = (bucket + 1) % historyBuckets;
+                filled = 0;
+                range.clear();
+            }
+        }
+        out[count*2 + 0] = range.minY;
+        out[count*2 + 1] = range.maxY;
+        return count + 1;
+    }
+};
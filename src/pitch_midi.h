@@ -0,0 +1,212 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// ピッチを MIDI のノートオン・オフとピッチベンドにして、ALSA シーケンサの仮想ポートへ出す（--midi）
+// ハードウェアは要らず、aconnect やシンセの入力から繋げる（PipeWire の ALSA シーケンサのブリッジがあれば PipeWire のグラフにも出る）
+// イベントは on_process の中で作り、コールバックの時刻にそのサンプルの位置を足した時刻でキューに予約するので、
+// イベントの間隔はサンプル単位で正確になる（その代わり1バッファ分遅れる）
+
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <alsa/asoundlib.h>
+
+#include "pitch_detector.h"
+#include "frame_stats.h"
+#include "chunk_capture.h"
+
+const int midiBaseNote = 33;             // A1（baseFrequency）のノート番号
+const float midiSemitonesPerY = 48.0f;   // y 座標 0〜1 は 55Hz〜880Hz の4オクターブ
+const float midiBendRange = 2.0f;        // ピッチベンドの幅（±2半音、多くのシンセの既定）
+const float midiHysteresis = 0.3f;       // ノートの境目（±0.5半音）からさらにこれだけ離れたら次のノートに切り替える
+const size_t midiOnsetSamples = 240;     // 同じノートが 5ms 続いたらノートオン（切り替えも）
+const size_t midiReleaseSamples = 1440;  // 30ms 続けて無声ならノートオフ（二つの窓が食い違った瞬間の -1 では切らない）
+const size_t midiBendInterval = 240;     // ピッチベンドは 5ms に1回まで（変わったときだけ）
+const uint64_t midiScheduleDelayNs = 1000000; // バッファの先頭のイベントも予約時刻までに書けるように 1ms 余分に遅らせる
+
+struct MidiEvent {
+    enum Type : uint8_t { NoteOn, NoteOff, PitchBend } type;
+    uint8_t note, velocity;
+    int16_t bend;    // -8192〜8191
+    uint32_t offset; // コールバックの中のサンプルの位置
+};
+
+// サンプルごとのピッチをノートとピッチベンドに変える（単音、チャンネル1）
+// 声の出だしは窓が埋まるまでピッチが飛ぶので、同じノートが midiOnsetSamples 続いてから鳴らす（ノートの切り替えも同じ）
+class PitchToMidi {
+    int note = -1;      // 鳴っているノート（なければ -1）
+    int candidate = -1; // 次に鳴らすかもしれないノート
+    int bend = 0;
+    size_t candidateRun = 0, unvoicedRun = 0, sinceBend = 0;
+
+    static int bendFor(float semitone, int note) {
+        return std::clamp((int)std::lround((semitone - note) / midiBendRange * 8192.0f), -8192, 8191);
+    }
+
+    // lagMax 幅の RMS を -50dB〜-10dB で 1〜127 に
+    static uint8_t velocityFor(double rmsSQ) {
+        double db = 10.0 * std::log10(std::max(rmsSQ / lagMax, 1e-12));
+        return (uint8_t)std::clamp((int)std::lround((db + 50.0) / 40.0 * 126.0) + 1, 1, 127);
+    }
+
+    // semitone がノート n の範囲（境目からさらに midiHysteresis まで）にある
+    static bool near(float semitone, int n) { return n >= 0 && std::abs(semitone - n) <= 0.5f + midiHysteresis; }
+
+public:
+    // 検出器が1サンプル進める度に呼ぶ（pitch は y 座標、無音は -1）。イベントができたら emit(const MidiEvent&) を呼ぶ
+    template <typename Emit>
+    void add(float pitch, double rmsSQ, uint32_t offset, Emit&& emit) {
+        sinceBend++;
+        if (pitch == -1.0f) {
+            candidate = -1;
+            if (++unvoicedRun == midiReleaseSamples && note >= 0) {
+                emit(MidiEvent{MidiEvent::NoteOff, (uint8_t)note, 0, 0, offset});
+                note = -1;
+            }
+            return;
+        }
+        unvoicedRun = 0;
+        float semitone = midiBaseNote + pitch * midiSemitonesPerY;
+
+        if (near(semitone, note)) {
+            candidate = -1;
+            if (sinceBend >= midiBendInterval) {
+                int newBend = bendFor(semitone, note);
+                if (newBend != bend) {
+                    bend = newBend;
+                    sinceBend = 0;
+                    emit(MidiEvent{MidiEvent::PitchBend, 0, 0, (int16_t)bend, offset});
+                }
+            }
+            return;
+        }
+        if (!near(semitone, candidate)) {
+            candidate = (int)std::lround(semitone);
+            candidateRun = 0;
+        }
+        if (++candidateRun < midiOnsetSamples)
+            return;
+
+        // 次のノートへ（ベンドを合わせてから鳴らす）
+        if (note >= 0)
+            emit(MidiEvent{MidiEvent::NoteOff, (uint8_t)note, 0, 0, offset});
+        note = candidate;
+        candidate = -1;
+        bend = bendFor(semitone, note);
+        sinceBend = 0;
+        emit(MidiEvent{MidiEvent::PitchBend, 0, 0, (int16_t)bend, offset});
+        emit(MidiEvent{MidiEvent::NoteOn, (uint8_t)note, velocityFor(rmsSQ), 0, offset});
+    }
+
+    // 鳴っているノートを止める
+    template <typename Emit>
+    void stop(Emit&& emit) {
+        if (note >= 0)
+            emit(MidiEvent{MidiEvent::NoteOff, (uint8_t)note, 0, 0, 0});
+        note = candidate = -1;
+        unvoicedRun = 0;
+    }
+};
+
+// ALSA シーケンサの仮想ポート（begin と add は on_process から呼ぶ。ブロックしない）
+class MidiOutput {
+    snd_seq_t* seq = nullptr;
+    int port = -1, queue = -1;
+    uint64_t queueStartNs = 0; // キューの時刻 0 の CLOCK_MONOTONIC
+    uint64_t callbackNs = 0;   // 処理しているコールバックの時刻
+    PitchToMidi converter;
+
+    uint64_t events = 0, lateEvents = 0;
+    std::atomic<uint64_t> droppedEvents{0};
+    DurationStats leadTimes; // イベントを書いてからその予約時刻まで
+
+    void send(const MidiEvent& e) {
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        snd_seq_ev_set_source(&ev, port);
+        snd_seq_ev_set_subs(&ev);
+        uint64_t dueNs = callbackNs + midiScheduleDelayNs + (uint64_t)(e.offset * 1e9 / sampleRate);
+        uint64_t t = dueNs - queueStartNs;
+        snd_seq_real_time_t time = {(unsigned int)(t / 1000000000ull), (unsigned int)(t % 1000000000ull)};
+        snd_seq_ev_schedule_real(&ev, queue, 0, &time);
+        switch (e.type) {
+            case MidiEvent::NoteOn: snd_seq_ev_set_noteon(&ev, 0, e.note, e.velocity); break;
+            case MidiEvent::NoteOff: snd_seq_ev_set_noteoff(&ev, 0, e.note, 0); break;
+            case MidiEvent::PitchBend: snd_seq_ev_set_pitchbend(&ev, 0, e.bend); break;
+        }
+        // コールバックの終わりにまとめて書くと、バッファの前の方のイベントは処理の時間だけ予約時刻を過ぎてしまうので、
+        // できた時にすぐ書く（検出器はリアルタイムより速く進むので、予約時刻より前に書ける）
+        if (snd_seq_event_output_direct(seq, &ev) < 0) {
+            droppedEvents.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        events++;
+        uint64_t now = monotonicNs();
+        if (now > dueNs)
+            lateEvents++;
+        else
+            leadTimes.add((dueNs - now) / 1e6);
+    }
+
+public:
+    bool open(const char* portName) {
+        if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, SND_SEQ_NONBLOCK) < 0)
+            return false;
+        snd_seq_set_client_name(seq, "Vocal Pitch Visualizer");
+        port = snd_seq_create_simple_port(seq, portName, SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+        queue = snd_seq_alloc_named_queue(seq, "pitch");
+        if (port < 0 || queue < 0) {
+            snd_seq_close(seq);
+            seq = nullptr;
+            return false;
+        }
+
+        // 既定のシステムタイマーは jiffies 単位なので、使えれば高分解能タイマーにする
+        snd_seq_queue_timer_t* timer;
+        snd_seq_queue_timer_alloca(&timer);
+        snd_timer_id_t* id;
+        snd_timer_id_alloca(&id);
+        snd_timer_id_set_class(id, SND_TIMER_CLASS_GLOBAL);
+        snd_timer_id_set_sclass(id, SND_TIMER_SCLASS_NONE);
+        snd_timer_id_set_card(id, -1);
+        snd_timer_id_set_device(id, SND_TIMER_GLOBAL_HRTIMER);
+        snd_timer_id_set_subdevice(id, 0);
+        if (snd_seq_get_queue_timer(seq, queue, timer) == 0) {
+            snd_seq_queue_timer_set_id(timer, id);
+            snd_seq_set_queue_timer(seq, queue, timer);
+        }
+
+        snd_seq_start_queue(seq, queue, nullptr);
+        snd_seq_drain_output(seq);
+        queueStartNs = monotonicNs();
+        return true;
+    }
+
+    int client() const { return snd_seq_client_id(seq); }
+    int portId() const { return port; }
+
+    void begin(uint64_t nowNs) { callbackNs = nowNs; }
+
+    void add(float pitch, double rmsSQ, uint32_t offset) {
+        converter.add(pitch, rmsSQ, offset, [this](const MidiEvent& e) { send(e); });
+    }
+
+    void close() {
+        if (!seq)
+            return;
+        callbackNs = monotonicNs();
+        converter.stop([this](const MidiEvent& e) { send(e); });
+        snd_seq_sync_output_queue(seq);
+        snd_seq_close(seq);
+        seq = nullptr;
+        printf("MIDI: %lu events, written ahead of their time by p1 %.2f p50 %.2f ms, %lu late\n",
+               (unsigned long)events, leadTimes.percentile(0.01), leadTimes.percentile(0.5), (unsigned long)lateEvents);
+        uint64_t dropped = droppedEvents.load();
+        if (dropped)
+            std::cerr << "MIDI output dropped " << dropped << " events because the sequencer queue was full!" << std::endl;
+    }
+};
@@ -0,0 +1,162 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+
+// pitch_visualizer --capture で記録したバッファの並びを、同じ大きさ・同じ時刻の間隔でピッチ検出に流し直す
+// 実機でしか出ないコールバックの揺らぎやまとめて届くバッファの挙動を、オフラインで再現して測るためのもの。
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "pitch_detector.h"
+#include "pitch_history.h"
+#include "chunk_capture.h"
+
+// 並べ替えて p 分位（0〜1）の値を返す
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+static void printStats(const char* name, const std::vector<double>& us) {
+    double sum = 0.0;
+    for (double v : us) sum += v;
+    std::cout << std::left << std::setw(22) << name << std::right << std::fixed << std::setprecision(1)
+              << " mean " << std::setw(9) << (us.empty() ? 0.0 : sum / us.size())
+              << "  p50 " << std::setw(9) << percentile(us, 0.5)
+              << "  p99 " << std::setw(9) << percentile(us, 0.99)
+              << "  max " << std::setw(9) << percentile(us, 1.0) << " us" << std::endl;
+}
+
+static void usage() {
+    std::cerr << "Usage: pitch_replay [-f] [-s speed] [-o output.f32] PREFIX" << std::endl
+              << "  PREFIX: files recorded by pitch_visualizer --capture PREFIX" << std::endl
+              << "  -f:     feed the buffers as fast as possible instead of at the recorded times" << std::endl
+              << "  -s:     playback speed for the recorded times (default 1.0)" << std::endl
+              << "  -o:     write the pitch (pitch, experiment) of every sample as raw 32bit float pairs" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bool paced = true;
+    double speed = 1.0;
+    const char* outputPath = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "fs:o:h")) != -1) {
+        switch (opt) {
+            case 'f': paced = false; break;
+            case 's': speed = atof(optarg); break;
+            case 'o': outputPath = optarg; break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || speed <= 0.0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    std::string prefix = argv[optind];
+
+    std::vector<ChunkRecord> chunks;
+    std::vector<float> samples;
+    if (!readChunkLog(prefix, chunks, samples) || chunks.empty()) {
+        std::cerr << "Failed to read " << prefix << ".chunks and " << prefix << ".f32. exit." << std::endl;
+        return EXIT_FAILURE;
+    }
+    size_t total = 0;
+    for (const auto& c : chunks)
+        total += c.numSamples;
+    if (total > samples.size()) {
+        std::cerr << "The audio is shorter than the chunk log (" << samples.size() << " < " << total << "). exit." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // 記録されたバッファの大きさと間隔
+    std::map<uint32_t, size_t> sizes;
+    std::vector<double> intervals;
+    size_t bursts = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        sizes[chunks[i].numSamples]++;
+        if (i == 0)
+            continue;
+        double interval = (chunks[i].timestampNs - chunks[i - 1].timestampNs) / 1000.0;
+        intervals.push_back(interval);
+        // 前のバッファの長さの 1/4 より早く届いたものはまとめて届いたとみなす
+        if (interval < chunks[i - 1].numSamples / sampleRate * 1e6 / 4)
+            bursts++;
+    }
+
+    auto det = std::make_unique<PitchDetector>();
+    std::vector<float> ring(pitchRingSize * 2);
+    std::vector<float> output;
+    if (outputPath)
+        output.resize(total * 2);
+
+    std::vector<double> processUs, lateUs;
+    size_t deadlineMisses = 0;
+    size_t pos = 0, writeIndex = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& c : chunks) {
+        auto target = start + std::chrono::nanoseconds((int64_t)((c.timestampNs - chunks[0].timestampNs) / speed));
+        if (paced)
+            std::this_thread::sleep_until(target);
+
+        auto begin = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < c.numSamples; t++, pos++) {
+            // on_process と同じようにリングバッファへ書き込む
+            det->processSample(samples[pos], ring[writeIndex*2 + 0], ring[writeIndex*2 + 1]);
+            if (outputPath) {
+                output[pos*2 + 0] = ring[writeIndex*2 + 0];
+                output[pos*2 + 1] = ring[writeIndex*2 + 1];
+            }
+            if (++writeIndex >= pitchRingSize)
+                writeIndex = 0;
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        // -s で速めたり遅くしたりしたときは、締め切りもその速さでの1バッファ分になる
+        double budgetUs = c.numSamples / sampleRate / speed * 1e6;
+        processUs.push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+        if (paced) {
+            double late = std::chrono::duration<double, std::micro>(begin - target).count();
+            lateUs.push_back(late);
+            if (late + processUs.back() > budgetUs)
+                deadlineMisses++;
+        } else if (processUs.back() > budgetUs) {
+            deadlineMisses++;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << chunks.size() << " callbacks, " << total << " samples (" << total / sampleRate << " s), replayed in "
+              << elapsed.count() << " s" << (paced ? "" : " (as fast as possible)") << std::endl;
+    std::cout << "buffer sizes:";
+    for (const auto& [size, count] : sizes)
+        std::cout << " " << size << "x" << count;
+    std::cout << std::endl;
+    printStats("recorded interval", intervals);
+    std::cout << "bursts (interval < 1/4 buffer): " << bursts << std::endl;
+    printStats("process time", processUs);
+    if (paced)
+        printStats("wakeup lateness", lateUs);
+    std::cout << "deadline misses: " << deadlineMisses << " / " << chunks.size() << std::endl;
+
+    if (outputPath) {
+        std::ofstream out(outputPath, std::ios::binary);
+        out.write((const char*)output.data(), output.size() * sizeof(float));
+        if (!out) {
+            std::cerr << "Failed to write " << outputPath << ". exit." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 書き込み1スレッド（on_process）・読み出し1スレッド（描画）の、サンプルごとのピッチのリングバッファ
+// ピッチには書いた順の通し番号（0 から単調に増え、折り返さない）が付く。書き込み側は待たずに古いものを上書きするので、
+// 読み出し側が1周以上遅れたときは、上書きされた分を飛ばして落とした数に数え、読んだ先頭の通し番号で飛んだことが分かるようにする
+// 読んでいる最中に上書きされたかは、読んだ後の書き込み位置で確かめる（値も atomic なので、競合しても未定義動作にはならない）
+template <size_t Capacity>
+class PitchRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static const size_t mask = Capacity - 1;
+
+    alignas(64) std::atomic<uint64_t> writeSeq{0}; // 書き込んだ数 = 次に書く通し番号（書き込み側だけが更新する）
+    alignas(64) uint64_t readSeq = 0;              // 次に読む通し番号（読み出し側だけが触る）
+    uint64_t dropped = 0;                          // 読む前に上書きされた数（読み出し側だけが触る）
+    alignas(64) std::atomic<float> pitch[Capacity];
+    alignas(64) std::atomic<float> pitchExperiment[Capacity];
+
+    // 書き込み位置が w のとき、まだ上書きされていない最も古い通し番号（w 番を書いている最中かもしれないので、その1周前は含めない）
+    static uint64_t oldestValid(uint64_t w) { return w >= Capacity ? w - Capacity + 1 : 0; }
+
+public:
+    // 書き込み側（リアルタイムスレッドから呼んでも良い。待たない）
+    void push(float p, float pe) {
+        uint64_t seq = writeSeq.load(std::memory_order_relaxed);
+        // 読み出し側が上書き中のスロットを読んだら、その後で読む writeSeq は少なくとも seq になる（seqlock と同じ）
+        std::atomic_thread_fence(std::memory_order_release);
+        pitch[seq & mask].store(p, std::memory_order_relaxed);
+        pitchExperiment[seq & mask].store(pe, std::memory_order_relaxed);
+        writeSeq.store(seq + 1, std::memory_order_release);
+    }
+
+    // これまでに書いた数（どちらのスレッドから呼んでも良い）
+    uint64_t written() const { return writeSeq.load(std::memory_order_acquire); }
+
+    // 読み出し側：まだ読んでいないピッチを最大 maxCount 個まとめて読み出し、読んだ数を返す
+    // 先頭の通し番号は firstSeq に入る（前に読んだものの続きより大きければ、その間は上書きされて落ちた）
+    size_t read(float* outPitch, float* outPitchExperiment, size_t maxCount, uint64_t& firstSeq) {
+        uint64_t w = writeSeq.load(std::memory_order_acquire);
+        if (readSeq < oldestValid(w)) {
+            dropped += oldestValid(w) - readSeq;
+            readSeq = oldestValid(w);
+        }
+        size_t count = std::min<uint64_t>(maxCount, w - readSeq);
+        for (size_t i = 0; i < count; i++) {
+            outPitch[i] = pitch[(readSeq + i) & mask].load(std::memory_order_relaxed);
+            outPitchExperiment[i] = pitchExperiment[(readSeq + i) & mask].load(std::memory_order_relaxed);
+        }
+
+        // 読んでいる間に書き込み側が追いついて上書きした分は捨てる
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t valid = oldestValid(writeSeq.load(std::memory_order_relaxed));
+        size_t overwritten = valid > readSeq ? std::min<uint64_t>(valid - readSeq, count) : 0;
+        if (overwritten > 0) {
+            count -= overwritten;
+            memmove(outPitch, outPitch + overwritten, count * sizeof(float));
+            memmove(outPitchExperiment, outPitchExperiment + overwritten, count * sizeof(float));
+            dropped += overwritten;
+            readSeq += overwritten;
+        }
+        firstSeq = readSeq;
+        readSeq += count;
+        return count;
+    }
+
+    // 次に読む通し番号と、これまでに落とした数（読み出し側から呼ぶ）
+    uint64_t readPosition() const { return readSeq; }
+    uint64_t droppedSamples() const { return dropped; }
+};
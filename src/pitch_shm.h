@@ -0,0 +1,257 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// 共有メモリでのピッチの配信（--publish NAME で書き、ほかのプロセスは PitchShmReader で読む）
+// 書き込み1つ・読み出しいくつでもの放送型のリングで、読み出し側が書くのは待っている数（waiters）だけなので、
+// 遅い読み出し側がいても書き込み側（on_process）は待たない。追い越されたフレームは読み出し側が失ったものとして数える
+//
+// スロットは seqlock：書き込み側は seq を奇数（書き込み中）にしてから中身を書き、フレームの通し番号 n に対して 2n+2 にする
+// 読み出し側は中身を読む前と後の seq が 2n+2 で一致すれば、読んだ中身が n 番のフレームだと分かる
+// 新しいフレームを書いたら futex の語を増やし、futex で待っている読み出し側がいるときだけ FUTEX_WAKE する（コールバックごとに最大1回）
+// 読み出し側は waiters を増やしてから futex の語を読み、書き込み側は futex の語を増やしてから waiters を読む（どちらも seq_cst）ので、
+// 書き込み側が 0 を読んだときは読み出し側が増えた語を見て待たずに戻り、起こし損ねない
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+
+#include "pitch_track.h"
+
+const char pitchShmMagic[8] = {'P', 'I', 'T', 'C', 'H', 'S', 'H', 'M'};
+const uint32_t pitchShmVersion = 2;
+const size_t pitchShmCapacity = 4096; // フレームの数（48000Hz で約5.5秒分）
+
+struct PitchShmSlot {
+    std::atomic<uint64_t> seq; // 2n+2 なら n 番のフレーム、奇数なら書き込み中
+    std::atomic<uint64_t> words[4]; // PitchFrame（読み書きが競合しても未定義動作にならないように語ごとの atomic）
+};
+static_assert(sizeof(PitchFrame) <= sizeof(PitchShmSlot::words), "PitchFrame must fit in a slot");
+
+struct PitchShmHeader {
+    char magic[8];         // 初期化が終わってから書く
+    uint32_t version;
+    uint32_t capacity;     // スロットの数（2のべき乗）
+    uint32_t sampleRate;
+    uint32_t frameSamples;
+    uint64_t startRealtimeNs; // 配信を始めた CLOCK_REALTIME の ns
+    alignas(64) std::atomic<uint64_t> writeSeq; // 書き終えたフレームの数
+    std::atomic<uint32_t> futexWord;            // フレームを書く度に増える（読み出し側はこれで待つ）
+    std::atomic<uint32_t> closed;               // 書き込み側が終了した
+    std::atomic<uint32_t> waiters;              // futex で待っている（待とうとしている）読み出し側の数
+    // この後にスロットが capacity 個並ぶ
+};
+static_assert(sizeof(PitchShmHeader) % alignof(PitchShmSlot) == 0, "slots follow the header");
+
+inline size_t pitchShmSize(size_t capacity) {
+    return sizeof(PitchShmHeader) + capacity * sizeof(PitchShmSlot);
+}
+
+inline PitchShmSlot* pitchShmSlots(PitchShmHeader* header) {
+    return (PitchShmSlot*)(header + 1);
+}
+
+inline const PitchShmSlot* pitchShmSlots(const PitchShmHeader* header) {
+    return (const PitchShmSlot*)(header + 1);
+}
+
+inline long pitchShmFutex(std::atomic<uint32_t>* word, int op, uint32_t value, const struct timespec* timeout) {
+    // 別のプロセスと共有するので FUTEX_PRIVATE_FLAG は付けない
+    return syscall(SYS_futex, (uint32_t*)word, op, value, timeout, nullptr, 0);
+}
+
+// 書き込み側（publish はリアルタイムスレッドから呼んでも良い）
+class PitchShmPublisher {
+    std::string name;
+    PitchShmHeader* header = nullptr;
+    uint64_t seq = 0;
+    bool published = false;
+
+public:
+    ~PitchShmPublisher() { close(); }
+
+    // 同じ名前のものが既にあれば失敗する（errno は EEXIST。動いている別のプロセスのものを奪わない）
+    // 異常終了して残ったものは /dev/shm から消してから開き直す
+    bool open(const char* shmName) {
+        name = shmName;
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0)
+            return false;
+        size_t size = pitchShmSize(pitchShmCapacity);
+        void* p = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            return false;
+        }
+        // ftruncate したばかりの領域は 0 なので、atomic もそのまま 0 として使える
+        // on_process が最初に書くときにページフォルトしないように、ここで全ページを割り当てておく
+        memset(p, 0, size);
+        header = (PitchShmHeader*)p;
+        header->version = pitchShmVersion;
+        header->capacity = pitchShmCapacity;
+        header->sampleRate = (uint32_t)sampleRate;
+        header->frameSamples = trackFrameSamples;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        header->startRealtimeNs = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, pitchShmMagic, sizeof(pitchShmMagic));
+        return true;
+    }
+
+    void publish(const PitchFrame& frame) {
+        PitchShmSlot& slot = pitchShmSlots(header)[seq & (pitchShmCapacity - 1)];
+        uint64_t words[4] = {0, 0, 0, 0};
+        memcpy(words, &frame, sizeof(frame));
+        slot.seq.store(seq * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int i = 0; i < 4; i++)
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+        slot.seq.store(seq * 2 + 2, std::memory_order_release);
+        header->writeSeq.store(++seq, std::memory_order_release);
+        published = true;
+    }
+
+    // publish したものがあれば待っている読み出し側を起こす（コールバックの終わりに1回。待っている者がいなければシステムコールはしない）
+    void wake() {
+        if (!published)
+            return;
+        published = false;
+        header->futexWord.fetch_add(1, std::memory_order_seq_cst);
+        if (header->waiters.load(std::memory_order_seq_cst) != 0)
+            pitchShmFutex(&header->futexWord, FUTEX_WAKE, INT_MAX, nullptr);
+    }
+
+    void close() {
+        if (!header)
+            return;
+        header->closed.store(1, std::memory_order_release);
+        header->futexWord.fetch_add(1, std::memory_order_release);
+        pitchShmFutex(&header->futexWord, FUTEX_WAKE, INT_MAX, nullptr);
+        munmap(header, pitchShmSize(pitchShmCapacity));
+        header = nullptr;
+        shm_unlink(name.c_str());
+    }
+
+    uint64_t frames() const { return seq; }
+};
+
+// 読み出し側の小さなライブラリ（共有メモリに書くのは wait の間の waiters だけ）
+// 書き込みの権限がない（別のユーザーが配信している）ときは読み出し専用でマップし、wait は futex の代わりに 1ms ごとに見に行く
+//   PitchShmReader reader;
+//   reader.open("/pitch_visualizer");
+//   PitchFrame frames[256];
+//   while (reader.wait(1000))
+//       for (size_t i = 0, n = reader.read(frames, 256); i < n; i++) ...
+class PitchShmReader {
+    PitchShmHeader* header = nullptr;
+    size_t size = 0;
+    bool writable = false; // waiters を増やして futex で待てる
+    uint64_t next = 0; // 次に読むフレームの番号
+    uint64_t lost = 0;
+
+public:
+    ~PitchShmReader() { close(); }
+
+    // 開いた時点より後に書かれたフレームから読む（書き込み側がまだいないか、終了したものなら false）
+    bool open(const char* shmName) {
+        close();
+        lost = 0;
+        writable = true;
+        int fd = shm_open(shmName, O_RDWR, 0);
+        if (fd < 0 && errno == EACCES) {
+            writable = false;
+            fd = shm_open(shmName, O_RDONLY, 0);
+        }
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* p = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(PitchShmHeader)
+                ? mmap(nullptr, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        PitchShmHeader* h = (PitchShmHeader*)p;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (memcmp(h->magic, pitchShmMagic, sizeof(pitchShmMagic)) != 0 || h->version != pitchShmVersion ||
+            h->closed.load(std::memory_order_acquire) || h->capacity == 0 || (h->capacity & (h->capacity - 1)) != 0 || pitchShmSize(h->capacity) > (size_t)st.st_size) {
+            munmap(p, st.st_size);
+            return false;
+        }
+        header = h;
+        size = st.st_size;
+        next = header->writeSeq.load(std::memory_order_acquire);
+        return true;
+    }
+
+    void close() {
+        if (header)
+            munmap((void*)header, size);
+        header = nullptr;
+    }
+
+    // まだ読んでいないフレームを最大 maxFrames 個読み出す。追い越されたものは飛ばして lostFrames に数える
+    size_t read(PitchFrame* out, size_t maxFrames) {
+        size_t count = 0;
+        uint64_t written = header->writeSeq.load(std::memory_order_acquire);
+        if (written - next > header->capacity) { // 一周以上遅れた
+            lost += written - header->capacity - next;
+            next = written - header->capacity;
+        }
+        while (count < maxFrames && next < written) {
+            const PitchShmSlot& slot = pitchShmSlots(header)[next & (header->capacity - 1)];
+            uint64_t before = slot.seq.load(std::memory_order_acquire);
+            uint64_t words[4];
+            for (int i = 0; i < 4; i++)
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = slot.seq.load(std::memory_order_relaxed);
+            if (before != next * 2 + 2 || after != before) { // 読んでいる間に上書きされた
+                lost++;
+                next++;
+                continue;
+            }
+            memcpy(&out[count++], words, sizeof(PitchFrame));
+            next++;
+        }
+        return count;
+    }
+
+    // 読んでいないフレームが来るまで最長 timeoutMs ミリ秒待つ（来れば true）
+    bool wait(int timeoutMs) {
+        if (!writable) {
+            for (int i = 0; i < timeoutMs && header->writeSeq.load(std::memory_order_acquire) == next && !closed(); i++) {
+                struct timespec ms = {0, 1000000L};
+                nanosleep(&ms, nullptr);
+            }
+            return header->writeSeq.load(std::memory_order_acquire) != next;
+        }
+        // 待っている間だけ数に入る（書き込み側はこれが 0 なら FUTEX_WAKE しない）
+        header->waiters.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t word = header->futexWord.load(std::memory_order_seq_cst);
+        if (header->writeSeq.load(std::memory_order_acquire) == next && !closed()) {
+            struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+            pitchShmFutex(&header->futexWord, FUTEX_WAIT, word, &timeout);
+        }
+        header->waiters.fetch_sub(1, std::memory_order_relaxed);
+        return header->writeSeq.load(std::memory_order_acquire) != next;
+    }
+
+    // 書き込み側が終了した（同じ名前で新しく始まったものを読むには open し直す）
+    bool closed() const { return header->closed.load(std::memory_order_acquire) != 0; }
+    uint64_t lostFrames() const { return lost; }
+    uint64_t nextFrame() const { return next; }
+    uint32_t frameSamples() const { return header->frameSamples; }
+    uint64_t startRealtimeNs() const { return header->startRealtimeNs; }
+};
@@ -0,0 +1,114 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+
+// pitch_visualizer --publish NAME が共有メモリで配信するピッチを読む例
+// PitchShmReader（pitch_shm.h）で futex を待ち、届いたフレームを読んで表示する。読み出し側が遅れても配信側には影響しない
+
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <unistd.h>
+
+#include "pitch_shm.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void usage() {
+    std::cerr << "Usage: pitch_shm_client [-a] [-r lines_per_sec] [NAME]" << std::endl
+              << "  NAME: the shared memory given to pitch_visualizer --publish (default /pitch_visualizer)" << std::endl
+              << "  -a:   print every frame instead of the newest voiced one" << std::endl
+              << "  -r:   lines per second without -a (default 10)" << std::endl;
+}
+
+static void printFrame(const PitchFrame& frame) {
+    static const char* names[12] = {"A", "A#", "B", "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#"};
+    printf("%10.3f s", frame.sampleIndex / sampleRate);
+    if (frame.voiced > 0) {
+        // y 座標（0〜1）は baseFrequency から maxDisplayPitch までの対数
+        double hz = baseFrequency * std::pow(maxDisplayPitch / baseFrequency, frame.pitch);
+        double semitones = 12.0 * std::log2(hz / baseFrequency);
+        long note = std::lround(semitones);
+        char noteName[24];
+        snprintf(noteName, sizeof(noteName), "%s%ld", names[note % 12], (note + 9) / 12 + 1);
+        printf("  %7.1f Hz  %-4s %+4.0f cents", hz, noteName, (semitones - note) * 100.0);
+    } else {
+        printf("  %7s Hz  %-4s %10s", "-", "-", "");
+    }
+    printf("  confidence %.2f  %6.1f dB  voiced %3.0f%%\n", frame.confidence, 20.0 * std::log10(std::max(frame.rms, 1e-6f)),
+           100.0 * frame.voiced / trackFrameSamples);
+}
+
+int main(int argc, char** argv) {
+    bool all = false;
+    double rate = 10.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "ar:h")) != -1) {
+        switch (opt) {
+            case 'a': all = true; break;
+            case 'r': rate = atof(optarg); break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 < argc || rate <= 0.0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    const char* name = optind < argc ? argv[optind] : "/pitch_visualizer";
+    signal(SIGINT, [](int) { interrupted = 1; });
+    signal(SIGTERM, [](int) { interrupted = 1; });
+
+    PitchShmReader reader;
+    uint64_t totalFrames = 0, totalLost = 0;
+    while (!interrupted) {
+        totalLost += reader.lostFrames();
+        // 配信側がまだいなければ始まるまで待つ
+        if (!reader.open(name)) {
+            std::cerr << "Waiting for " << name << "..." << std::endl;
+            while (!interrupted && !reader.open(name))
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            if (interrupted)
+                break;
+        }
+        std::cerr << "Reading " << name << std::endl;
+
+        PitchFrame frames[256];
+        auto lastLine = std::chrono::steady_clock::now();
+        bool pending = false;
+        PitchFrame newest{};
+        while (!interrupted) {
+            if (!reader.wait(100)) {
+                if (reader.closed())
+                    break;
+                continue;
+            }
+            size_t n;
+            while ((n = reader.read(frames, 256)) > 0) {
+                totalFrames += n;
+                for (size_t i = 0; i < n; i++) {
+                    if (all)
+                        printFrame(frames[i]);
+                    else if (frames[i].voiced > 0 || !pending) {
+                        newest = frames[i];
+                        pending = true;
+                    }
+                }
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (pending && now - lastLine >= std::chrono::duration<double>(1.0 / rate)) {
+                printFrame(newest);
+                pending = false;
+                lastLine = now;
+            }
+            fflush(stdout);
+        }
+        if (!interrupted)
+            std::cerr << name << " was closed" << std::endl;
+    }
+    totalLost += reader.lostFrames();
+    std::cerr << "Read " << totalFrames << " frames, lost " << totalLost << std::endl;
+    return 0;
+}
@@ -0,0 +1,259 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// 歌ったピッチの記録（--record で書き、--replay で再生する）
+// trackFrameSamples サンプルごとに1フレーム（ピッチ、確からしさ、有声の割合、RMS）を、
+// 前のフレームとの差を zigzag の可変長整数にして書く（声が続いている間は1フレーム6〜8バイト程度）
+//
+//   ヘッダ : "PTRK", 版（u32）, サンプリングレート（u32）, フレームのサンプル数（u32）, 記録を始めた CLOCK_REALTIME の ns（u64）
+//   フレーム : サンプル番号の差（varint）と、以下の量子化した値の差（zigzag varint）
+//              pitch, pitchExperiment : y 座標 × 65534 + 1（無音は 0）
+//              confidence             : 0〜255
+//              voiced                 : フレーム内の有声サンプル数（0〜trackFrameSamples）
+//              rms                    : dB × 4（-120dB で打ち切り）
+// 整数はすべてリトルエンディアン
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <time.h>
+
+#include "pitch_detector.h"
+#include "pitch_history.h"
+#include "spsc_ring.h"
+
+const uint32_t trackVersion = 1;
+const size_t trackFrameSamples = historyBucketSamples; // 48000Hz で約1.3ms
+
+struct PitchFrame {
+    uint64_t sampleIndex;  // フレームの終わりのサンプル番号（検出器の sampleIndex）
+    float pitch;           // フレーム内で最後の有声サンプルのピッチ（y 座標、なければ -1）
+    float pitchExperiment; // 同じく検証前のピッチ
+    float confidence;      // フレームの終わりの自己相関の最大値を rmsSQ で割ったもの（0〜1）
+    float rms;             // フレームの終わりの lagMax 幅の RMS 振幅
+    uint16_t voiced;       // 有声サンプルの数
+};
+
+struct PitchTrackHeader {
+    uint32_t sampleRate = (uint32_t)::sampleRate;
+    uint32_t frameSamples = trackFrameSamples;
+    uint64_t startRealtimeNs = 0;
+};
+
+// サンプルごとのピッチを trackFrameSamples ごとのフレームにまとめる（リアルタイムスレッドから呼んでも良い）
+class PitchFrameBuilder {
+    uint16_t voiced = 0;
+    float lastPitch = -1.0f, lastPitchExperiment = -1.0f;
+
+public:
+    // 検出器が1サンプル進める度に呼び、フレームが出来たら frame に書いて true を返す
+    bool add(const PitchDetector& detector, float pitch, float pitchExperiment, PitchFrame& frame) {
+        if (pitch != -1.0f) {
+            voiced++;
+            lastPitch = pitch;
+        }
+        if (pitchExperiment != -1.0f)
+            lastPitchExperiment = pitchExperiment;
+        if (detector.sampleIndex % trackFrameSamples != 0)
+            return false;
+
+        frame = PitchFrame{detector.sampleIndex, lastPitch, lastPitchExperiment, detector.confidence(),
+                           (float)std::sqrt(detector.rmsSQ / lagMax), voiced};
+        voiced = 0;
+        lastPitch = lastPitchExperiment = -1.0f;
+        return true;
+    }
+};
+
+// フレームを差分符号化してバイト列に足す
+class PitchTrackEncoder {
+    int32_t last[5] = {0, 0, 0, 0, 0};
+    uint64_t lastIndex = 0;
+
+    static void putVarint(std::vector<uint8_t>& out, uint64_t x) {
+        while (x >= 0x80) {
+            out.push_back((uint8_t)(x | 0x80));
+            x >>= 7;
+        }
+        out.push_back((uint8_t)x);
+    }
+
+public:
+    static int32_t quantizePitch(float y) { return y < 0.0f ? 0 : (int32_t)std::lround(std::clamp(y, 0.0f, 1.0f) * 65534.0f) + 1; }
+    static int32_t quantizeRms(float rms) { return (int32_t)std::lround(std::max(20.0f * std::log10(std::max(rms, 1e-6f)), -120.0f) * 4.0f); }
+
+    static void putHeader(std::vector<uint8_t>& out, const PitchTrackHeader& header) {
+        out.insert(out.end(), {'P', 'T', 'R', 'K'});
+        for (uint64_t x : {(uint64_t)trackVersion, (uint64_t)header.sampleRate, (uint64_t)header.frameSamples})
+            for (int i = 0; i < 4; i++)
+                out.push_back((uint8_t)(x >> (i * 8)));
+        for (int i = 0; i < 8; i++)
+            out.push_back((uint8_t)(header.startRealtimeNs >> (i * 8)));
+    }
+
+    void put(std::vector<uint8_t>& out, const PitchFrame& frame) {
+        putVarint(out, frame.sampleIndex - lastIndex);
+        lastIndex = frame.sampleIndex;
+        int32_t values[5] = {
+            quantizePitch(frame.pitch),
+            quantizePitch(frame.pitchExperiment),
+            (int32_t)std::lround(std::clamp(frame.confidence, 0.0f, 1.0f) * 255.0f),
+            (int32_t)frame.voiced,
+            quantizeRms(frame.rms),
+        };
+        for (int i = 0; i < 5; i++) {
+            int32_t delta = values[i] - last[i];
+            putVarint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+            last[i] = values[i];
+        }
+    }
+};
+
+// 記録を読み込む
+inline bool readPitchTrack(const std::string& path, PitchTrackHeader& header, std::vector<PitchFrame>& frames) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    std::vector<uint8_t> bytes;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        bytes.insert(bytes.end(), buf, buf + n);
+    fclose(f);
+
+    auto get = [&](size_t pos, int size) {
+        uint64_t x = 0;
+        for (int i = 0; i < size; i++)
+            x |= (uint64_t)bytes[pos + i] << (i * 8);
+        return x;
+    };
+    if (bytes.size() < 24 || memcmp(bytes.data(), "PTRK", 4) != 0 || get(4, 4) != trackVersion)
+        return false;
+    header.sampleRate = get(8, 4);
+    header.frameSamples = get(12, 4);
+    header.startRealtimeNs = get(16, 8);
+
+    size_t pos = 24;
+    auto getVarint = [&](uint64_t& x) {
+        x = 0;
+        for (int shift = 0; pos < bytes.size() && shift < 64; shift += 7) {
+            uint8_t b = bytes[pos++];
+            x |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return true;
+        }
+        return false;
+    };
+    int32_t last[5] = {0, 0, 0, 0, 0};
+    uint64_t index = 0;
+    while (pos < bytes.size()) {
+        uint64_t x;
+        if (!getVarint(x))
+            break; // 書きかけのフレーム
+        index += x;
+        int i = 0;
+        for (; i < 5 && getVarint(x); i++)
+            last[i] += (int32_t)((uint32_t)(x >> 1) ^ -(uint32_t)(x & 1));
+        if (i < 5)
+            break;
+        frames.push_back(PitchFrame{
+            index,
+            last[0] ? (last[0] - 1) / 65534.0f : -1.0f,
+            last[1] ? (last[1] - 1) / 65534.0f : -1.0f,
+            last[2] / 255.0f,
+            last[4] <= -480 ? 0.0f : std::pow(10.0f, last[4] / 80.0f),
+            (uint16_t)last[3],
+        });
+    }
+    return true;
+}
+
+// on_process で出来たフレームを push し、書き込み用のスレッドが符号化してファイルへ書き出す
+class PitchTrackRecorder {
+    SpscRing<PitchFrame, 16384> frameRing; // 約21秒分
+    std::atomic<uint64_t> droppedFrames{0};
+    std::atomic<bool> running{false};
+    FILE* file = nullptr;
+    std::thread writer;
+    PitchTrackEncoder encoder;
+    std::vector<uint8_t> encoded;
+    uint64_t writtenFrames = 0, writtenBytes = 0;
+    int writeError = 0; // 最初に書き込みに失敗したときの errno（0 なら失敗していない）
+
+    void check(bool ok) {
+        if (!ok && !writeError)
+            writeError = errno ? errno : EIO;
+    }
+
+    void drain() {
+        PitchFrame frames[1024];
+        size_t n;
+        while ((n = frameRing.pop(frames, 1024)) > 0) {
+            encoded.clear();
+            for (size_t i = 0; i < n; i++)
+                encoder.put(encoded, frames[i]);
+            check(fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size());
+            writtenFrames += n;
+            writtenBytes += encoded.size();
+        }
+        check(fflush(file) == 0);
+    }
+
+public:
+    bool open(const std::string& path) {
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        PitchTrackHeader header;
+        header.startRealtimeNs = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        encoded.clear();
+        PitchTrackEncoder::putHeader(encoded, header);
+        check(fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size());
+        writtenBytes = encoded.size();
+        encoded.reserve(1024 * 16);
+
+        running = true;
+        writer = std::thread([this]() {
+            while (running.load(std::memory_order_relaxed)) {
+                drain();
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+            drain();
+        });
+        return true;
+    }
+
+    // リアルタイムスレッドから呼ぶ（割り当てもシステムコールもしない）
+    void push(const PitchFrame& frame) {
+        if (!frameRing.push(frame))
+            droppedFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void close() {
+        if (!running)
+            return;
+        running = false;
+        writer.join();
+        check(fclose(file) == 0);
+        file = nullptr;
+        std::cerr << "Recorded " << writtenFrames << " pitch frames (" << writtenFrames * trackFrameSamples / sampleRate << " s, "
+                  << writtenBytes / 1024 << " KiB, " << (writtenFrames ? (double)writtenBytes / writtenFrames : 0.0) << " bytes/frame)" << std::endl;
+        uint64_t dropped = droppedFrames.load();
+        if (dropped)
+            std::cerr << "Recording dropped " << dropped << " frames because the writer could not keep up!" << std::endl;
+        if (writeError)
+            std::cerr << "Writing the pitch recording failed: " << strerror(writeError) << ", the file is incomplete!" << std::endl;
+    }
+};
@@ -1,10 +1,15 @@
 // SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
 // SPDX-License-Identifier: LGPL-2.0-or-later
 
-// g++ pitch_visualizer.cpp -I/usr/include/spa-0.2/ -I/usr/include/pipewire-0.3/ -lglfw -lGLEW  -lGL -lpipewire-0.3 -lcap -o pitch_visualizer
+// g++ pitch_visualizer.cpp pitch_detector.cpp -DENABLE_PIPEWIRE -DENABLE_ALSA -I/usr/include/spa-0.2/ -I/usr/include/pipewire-0.3/ -lglfw -lGLEW  -lGL -lEGL -lz -lasound -lpipewire-0.3 -lcap -o pitch_visualizer
 // sudo setcap 'cap_sys_nice=eip' ./pitch_visualizer
 
 #define ENABLE_REALTIME
+#define ENABLE_HEADLESS // --render と --render-bench（EGL によるオフスクリーン描画）
+// ENABLE_PIPEWIRE（--input pipewire）と ENABLE_ALSA（--input alsa と --midi）はリンクするライブラリと合わせて Makefile で決める
+#ifdef ENABLE_ALSA
+#define ENABLE_MIDI     // --midi（ALSA シーケンサへの MIDI 出力）
+#endif
 
 #include <iostream>
 #include <atomic>
@@ -16,6 +21,11 @@
 #include <cstring>
 #include <cmath>
 #include <cassert>
+#include <algorithm>
+#include <memory>
+#include <chrono>
+#include <csignal>
+#include <getopt.h>
 
 #ifdef ENABLE_REALTIME
 #include <sys/mman.h>
@@ -23,59 +33,126 @@
 #include <sys/resource.h>
 #endif
 
-#include <pipewire/pipewire.h>
-#include <spa/param/format.h>
-#include <spa/param/audio/format-utils.h>
-#include <spa/param/audio/raw-utils.h>
-
 // OpenGL 関連ヘッダ
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#ifdef ENABLE_HEADLESS
+#define EGL_NO_X11 // Xlib のマクロ（None など）を持ち込まない
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "pitch_detector.h"
+#include "audio_backend.h"
+#ifdef ENABLE_PIPEWIRE
+#include "pipewire_backend.h"
+#endif
+#ifdef ENABLE_ALSA
+#include "alsa_backend.h"
+#endif
+#include "pitch_history.h"
+#include "pitch_ring.h"
+#include "chunk_capture.h"
+#include "callback_timing.h"
+#include "trace.h"
+#include "metrics.h"
+#include "latency_probe.h"
+#include "overload_ladder.h"
+#include "frame_stats.h"
+#include "triple_buffer.h"
+#include "correlogram.h"
+#include "pitch_archive.h"
+#include "pitch_track.h"
+#include "pitch_shm.h"
+#ifdef ENABLE_HEADLESS
+#include "png_writer.h"
+#endif
+#ifdef ENABLE_MIDI
+#include "pitch_midi.h"
+#endif
+
+// 現在のピッチ（y 座標）のリングバッファ（on_process が書き、描画スレッドが読む）
+PitchRing<pitchRingSize> pitchRing;
+
+// 音声の入力元（--input、既定は PipeWire、なければ ALSA、どちらもなければ合成音声）
+std::unique_ptr<AudioBackend> audioBackend;
+#if defined(ENABLE_PIPEWIRE)
+const char* const defaultAudioInput = "pipewire";
+#elif defined(ENABLE_ALSA)
+const char* const defaultAudioInput = "alsa";
+#else
+const char* const defaultAudioInput = "synthetic";
+#endif
+
+// --input の値からバックエンドを作る（分からないか、ビルドに入っていなければ nullptr）
+static std::unique_ptr<AudioBackend> makeAudioBackend(const std::string& spec) {
+#ifdef ENABLE_PIPEWIRE
+    if (spec == "pipewire")
+        return std::make_unique<PipeWireBackend>();
+#endif
+#ifdef ENABLE_ALSA
+    if (spec == "alsa")
+        return std::make_unique<AlsaBackend>(alsaDefaultDevice);
+    if (spec.rfind("alsa:", 0) == 0 && spec.size() > 5)
+        return std::make_unique<AlsaBackend>(spec.c_str() + 5);
+#endif
+    return makeBasicAudioBackend(spec);
+}
+
+// ピッチ検出器（on_process 内で使用）
+PitchDetector detector;
 
-#include "lag_to_y.h"
+// --capture 指定時のバッファの記録（on_process 内で使用）
+std::unique_ptr<ChunkCapture> chunkCapture;
 
-// サンプリングレート（48000Hz固定）
-const float sampleRate = 48000.0f;
-#define SMPLING_RATE_STR "48000"
+// --record 指定時のピッチの記録と --publish 指定時の共有メモリでの配信（on_process 内で使用）
+std::unique_ptr<PitchTrackRecorder> pitchTrack;
+std::unique_ptr<PitchShmPublisher> pitchShm;
+PitchFrameBuilder pitchFrameBuilder;
 
-// 量子化
-#define QUANTUM_STR "32"
+#ifdef ENABLE_MIDI
+// --midi 指定時の MIDI 出力（on_process 内で使用）
+std::unique_ptr<MidiOutput> midiOutput;
+#endif
 
-// 表示用の上限ピッチ（Hz） 
-const float maxDisplayPitch = 880.000f; // A6 の周波数
+// on_process の処理時間（T キーか --timing で左下にヒストグラムを表示し、終了時にも表示する）
+CallbackTiming callbackTiming;
+std::atomic<bool> timingOverlay = false;
 
-// 表示用の下限ピッチ（Hz） 
-const float baseFrequency = 55.0f; // A1 の周波数 (基準音)
+// 動作状況の数（on_process、描画スレッド、on_param_changed が書き、--metrics 指定時はソケットで読める）
+PipelineMetrics pipelineMetrics;
+std::unique_ptr<MetricsServer> metricsServer;
 
-// 現在のピッチ（Hz）の1秒分のリングバッファ
-float currentPitchRing[(size_t)sampleRate] = {0.0};
-float currentPitchRingExperiment[(size_t)sampleRate] = {0.0};
-std::atomic<size_t> currentPitchWriteIndex = 0;
-size_t currentPitchReadIndex = 0; // thread unsafe
-size_t currentPitchReadIndex2 = 0; // thread unsafe
+// 負荷が高いときに検出器を軽くする（--no-degrade でなければ on_process 内で使用）
+std::unique_ptr<OverloadLadder> overloadLadder;
 
-// グローバルストリームポインタ（on_process 内で使用）
-static struct pw_stream* g_stream = nullptr;
+// --latency 指定時の収録から表示までの時間（on_process 内で使用）
+std::unique_ptr<LatencyProbe> latencyProbe;
 
-const size_t lagMin = ceil(sampleRate / maxDisplayPitch); // 54
-const size_t lagMax = floor(sampleRate / baseFrequency) + 1; // 873
-double lag_to_correlation[lagMax - lagMin] = {0.0}; // lagMax幅で取った自己相関
-double lag_to_correlation_double[lagMax - lagMin] = {0.0}; // lagMax*2幅で取った自己相関
+// --trace 指定時のトレース（なければ区間を書かない）
+std::unique_ptr<Tracer> tracer;
+std::atomic<bool> quitRequested = false; // --trace のときの SIGINT と SIGTERM（トレースを書いてから終わる）
 
-// 過去のサンプルを保持するためのリングバッファ
-const size_t previousSamplesBase = ceil(log2(lagMax + lagMax + lagMax));
-const size_t previousSamplesMax = 2 << previousSamplesBase; // 2**base
-const size_t previousSamplesMask = previousSamplesMax - 1;
-float previousSamples[previousSamplesMax] = {0.0}; // 55Hzのサンプルの2倍幅ずらしに対応
-size_t previousSamplesDoubleRemovePos = 0;
-size_t previousSamplesRemovePos = lagMax;
-size_t previousSamplesAddPos = lagMax + lagMax;
+static const TraceKind traceOnProcess = {"on_process", "audio", {"samples"}};
+static const TraceKind traceUpdate = {"update", "audio", {"samples"}};
+static const TraceKind tracePeakSearch = {"peak search", "audio", {"samples"}};
+static const TraceKind traceParamChanged = {"param_changed", "pipewire", {"id"}};
+static const TraceKind traceLatency = {"latency", "input", {"min_rate", "max_rate", "max_ns"}};
+static const TraceKind traceFrame = {"frame", "render", {}};
+static const TraceKind traceFill = {"fill", "render", {"samples"}};
+static const TraceKind traceMap = {"map", "render", {"rows"}};
+static const TraceKind traceDraw = {"draw", "render", {}};
+static const TraceKind traceSwap = {"swap", "render", {}};
 
-double rmsSQ = 0.0f;
-// double rmsSQ[lagMax - lagMin] = {0.0f};
+// コレログラム（--correlogram か C キーで表示している間だけ on_process が自己相関を渡す）
+std::atomic<bool> correlogramEnabled = false;
+TripleBuffer<CorrelogramFrame> correlogramBuffer;
 
-const float amplitudeThreshold = 0.005f; // 小さな音の閾値
-float newPitch = 0.0f;
+// 起動の各段階の時刻（CLOCK_MONOTONIC の ns、0 ならまだ）。音声の入力の接続と GL の初期化は並行して進む
+uint64_t startupNs = 0; // main に入った時刻
+uint64_t mlockDoneNs = 0, glfwReadyNs = 0, windowReadyNs = 0, glReadyNs = 0, firstFrameNs = 0;
+std::atomic<uint64_t> audioConnectedNs = 0, firstAudioNs = 0, firstPitchNs = 0;
+std::atomic<bool> audioFailed = false; // 接続に失敗したらレンダリングループを抜ける
 
 
 // baseFrequency を基に全音と半音を算出
@@ -83,326 +160,389 @@ float calculateNoteFrequency(float baseFrequency, int semitoneOffset) {
     return baseFrequency * std::pow(2.0f, semitoneOffset / 12.0f);
 }
 
-double sqr(double x){
-    return x*x;
-}
-#include <cfloat>
-
-// ピッチを計算
-static void on_process([[maybe_unused]] void *userdata) {
-    struct pw_stream *stream = g_stream;
-    struct pw_buffer *buffer = pw_stream_dequeue_buffer(stream);
-    if (buffer == nullptr)
-        return;
-
-    if (buffer->buffer->n_datas > 0) {
-        struct spa_data *d = &buffer->buffer->datas[0];
-        if (d->data == nullptr || d->chunk == nullptr) {
-            pw_stream_queue_buffer(stream, buffer);
-            return;
+// 音声を検出器に通してピッチをリングバッファへ書く（on_process とオフスクリーン描画で共通）
+static void processAudio(const float* audioData, size_t numSamples) {
+    // トレースするときは自己相関の更新とピーク探索の時間をそれぞれ足していき、最後に続けて2つの区間として書く
+    uint64_t traceStartNs = tracer ? monotonicNs() : 0, updateNs = 0, peakSearchNs = 0;
+    size_t voiced = 0;
+
+    // ここで t を 0 から numSamples まで繰り返してずらしながら処理する
+    for (size_t t = 0; t < numSamples; t++) {
+        // 小さい音のピッチはリングバッファに-1が格納される
+        float pitch, pitchExperiment;
+        if (tracer) {
+            uint64_t t0 = monotonicNs();
+            detector.updateCorrelation(audioData[t]);
+            uint64_t t1 = monotonicNs();
+            detector.detect(pitch, pitchExperiment);
+            updateNs += t1 - t0;
+            peakSearchNs += monotonicNs() - t1;
+        } else {
+            detector.processSample(audioData[t], pitch, pitchExperiment);
         }
-
-        size_t offset = d->chunk->offset;
-        size_t size = d->chunk->size;
-        size_t numSamples = size / sizeof(float);
-        float* audioData = (float*)((uint8_t*)d->data + offset);
-
-
-
-/*        if (previousSamplesLen < numSamples){ // 例えばnumSamples=940と941が交互に来る
-//            std::cout << "init with " << numSamples << std::endl;
+        PitchFrame frame;
+        if ((pitchTrack || pitchShm) && pitchFrameBuilder.add(detector, pitch, pitchExperiment, frame)) {
+            if (pitchTrack)
+                pitchTrack->push(frame);
+            if (pitchShm)
+                pitchShm->publish(frame);
         }
-*/
-
-//        std::cout << numSamples << std::endl;
-
-        // ここで t を 0 から numSamples まで繰り返してずらしながら処理する
-        for (size_t t = 0; t < numSamples; t++) {
-//            std::cout << previousSamplesRemovePos << ":: " << previousSamplesAddPos << ":: " << lagMax << std::endl;
-//                assert((previousSamplesRemovePos + lagMax - previousSamplesAddPos) % lagMax == 0);
-
-            previousSamples[previousSamplesAddPos] = audioData[t];
-            rmsSQ -= (double)previousSamples[previousSamplesRemovePos] * previousSamples[previousSamplesRemovePos];
-            rmsSQ += (double)previousSamples[previousSamplesAddPos] * previousSamples[previousSamplesAddPos];
-
-            size_t previousSampleRemoveLagPos = (previousSamplesRemovePos - lagMin) & previousSamplesMask;
-            size_t previousSampleRemoveDoubleLagPos = (previousSamplesDoubleRemovePos - lagMin) & previousSamplesMask;
-            size_t previousSampleAddLagPos = (previousSamplesAddPos - lagMin) & previousSamplesMask;
-
-            // RMS振幅の計算と自己相関法によるピッチ検出
-//            for (size_t lag = lagMin; lag < lagMax; lag++) {
-            for (size_t idx = 0; idx < lagMax-lagMin; idx++) {
-                lag_to_correlation[/*lag - lagMin*/idx] -= (double)previousSamples[previousSamplesRemovePos] * previousSamples[previousSampleRemoveLagPos];
-                lag_to_correlation_double[/*lag - lagMin*/idx] -= (double)previousSamples[previousSamplesDoubleRemovePos] * previousSamples[previousSampleRemoveDoubleLagPos];
-
-                lag_to_correlation[/*lag - lagMin*/idx] += (double)previousSamples[previousSamplesAddPos] * previousSamples[previousSampleAddLagPos];
-                lag_to_correlation_double[/*lag - lagMin*/idx] += (double)previousSamples[previousSamplesAddPos] * previousSamples[previousSampleAddLagPos];
-
-                previousSampleRemoveLagPos = (previousSampleRemoveLagPos - 1) & previousSamplesMask;
-                previousSampleRemoveDoubleLagPos = (previousSampleRemoveDoubleLagPos - 1) & previousSamplesMask;
-                previousSampleAddLagPos = (previousSampleAddLagPos - 1) & previousSamplesMask;
-            }
-
-            previousSamplesDoubleRemovePos = (previousSamplesDoubleRemovePos + 1) & previousSamplesMask;
-            previousSamplesRemovePos = (previousSamplesRemovePos + 1) & previousSamplesMask;
-            previousSamplesAddPos = (previousSamplesAddPos + 1) & previousSamplesMask;
-
-            if (rmsSQ < amplitudeThreshold * amplitudeThreshold * lagMax) { // 小さい音のピッチは無視してリングバッファに-1を格納する
-                currentPitchRing[currentPitchWriteIndex] = -1;
-                currentPitchRingExperiment[currentPitchWriteIndex] = -1;
-                //prevLag = lagMin;
-            } else { // 有効な音はピッチの検出を最後まで進めてリングバッファに格納する
-                float bestCorrelation = 0.0f;
-
-/*                size_t bestLag = 0;
-                size_t secondBesｔLag = lagMin;
-                size_t thirdBesｔLag = lagMin;
-*/
-
-                for (size_t lag = lagMin; lag < lagMax; lag++) {
-                    float corr = lag_to_correlation[lag - lagMin];
-                    if (bestCorrelation < corr) {
-                        bestCorrelation = corr;
-//                        bestLag = lag;
-                    }
-                }
-
-                bool found = false;
-                float reBestCorrelation = 0.0, accurateBestCorrelation = 0.0;
-                newPitch = 0.0;
-                size_t reBestLag =0/*, newBestLag = 0*/;
-                for (size_t lag = lagMin; lag < lagMax; lag++) {
-                    float corr = lag_to_correlation[lag - lagMin];
-                    if (bestCorrelation * 0.8 < corr) {
-                        found = true;
-                        if (reBestCorrelation < corr) {
-                            reBestCorrelation = corr;
-                            reBestLag = lag;
-                        }
-                    } else if (found) {
-                        if (reBestLag-1 >= lagMin && reBestLag+1 < lagMax) {
-                            // 二次曲線による補間
-                            // x = (y2-y0) / (2*(2*y1 - y0 - y2))
-                            // y = y1 + (y2-y0)**2 / (8 * (2*y1 - y0 - y2))
-                            double y0 = lag_to_correlation[reBestLag - lagMin - 1],
-                                   y1 = corr,
-                                   y2 = lag_to_correlation[reBestLag - lagMin + 1];
-                            float tAccurateBestCorrelation = y1 + sqr(y2-y0) / (8 * (2*y1 - y0 - y2));
-
-                            if (accurateBestCorrelation < tAccurateBestCorrelation) {
-                                accurateBestCorrelation = tAccurateBestCorrelation;
-//                                newBestLag = reBestLag + (y2-y0) / (2*(2*y1 - y0 - y2));
-//                                newPitch = log2(sampleRate / newBestLag / baseFrequency) / log2(maxDisplayPitch / baseFrequency);
-                                newPitch = lag_to_y[reBestLag - lagMin]; // 横着する
-                            }
-                        }
-                        found = false;
-                        reBestCorrelation = FLT_MAX;
-                    }
-                }
-
-/*
-                if (std::abs(lag_to_y[secondBesｔLag - lagMin] - newPitch) > 0.025)
-                    newPitch = -1.0f;
-                if (std::abs(lag_to_y[thirdBesｔLag - lagMin] - newPitch) > 0.025)
-                    newPitch = -1.0f;
-                if (std::abs(lag_to_y[thirdBesｔLag - lagMin] - lag_to_y[secondBesｔLag - lagMin]) > 0.025)
-                    newPitch = -1.0f;
-*/
-
-                currentPitchRingExperiment[currentPitchWriteIndex] = newPitch;//lag_to_y[bestLag2 - lagMin];//newPitch;
-
-/*
-                if (bestCorrelation / sqrt(rmsSQ) > 0.8) // 音量の割にパワー多い
-                    newPitch = -1.0f;
-*/
-
-                float newPitch2 = 0.0f;
-                bestCorrelation = 0.0f;
-
-/*                bestLag = 0;
-                secondBesｔLag = lagMin;
-                thirdBesｔLag = lagMin;
-*/
-
-                for (size_t lag = lagMin; lag < lagMax; lag++) {
-                    float corr = lag_to_correlation_double[lag - lagMin];
-                    if (bestCorrelation < corr) {
-                        bestCorrelation = corr;
-//                        bestLag = lag;
-                    }
-                }
-
-                found = false;
-                reBestCorrelation = 0.0, accurateBestCorrelation = 0.0;
-                reBestLag =0/*, newBestLag = 0*/;
-                for (size_t lag = lagMin; lag < lagMax; lag++) {
-                    float corr = lag_to_correlation_double[lag - lagMin];
-                    if (bestCorrelation * 0.8 < corr) {
-                        found = true;
-                        if (reBestCorrelation < corr) {
-                            reBestCorrelation = corr;
-                            reBestLag = lag;
-                        }
-                    } else if (found) {
-                        if (reBestLag-1 >= lagMin && reBestLag+1 < lagMax) {
-                            // 二次曲線による補間
-                            // x = (y2-y0) / (2*(2*y1 - y0 - y2))
-                            // y = y1 + (y2-y0)**2 / (8 * (2*y1 - y0 - y2))
-                            double y0 = lag_to_correlation_double[reBestLag - lagMin - 1],
-                                   y1 = corr,
-                                   y2 = lag_to_correlation_double[reBestLag - lagMin + 1];
-                            float tAccurateBestCorrelation = y1 + sqr(y2-y0) / (8 * (2*y1 - y0 - y2));
-
-                            if (accurateBestCorrelation < tAccurateBestCorrelation) {
-                                accurateBestCorrelation = tAccurateBestCorrelation;
-//                                newBestLag = reBestLag + (y2-y0) / (2*(2*y1 - y0 - y2));
-//                                newPitch2 = log2(sampleRate / newBestLag / baseFrequency) / log2(maxDisplayPitch / baseFrequency);
-                                newPitch2 = lag_to_y[reBestLag - lagMin]; // 横着する
-                            }
-                        }
-                        found = false;
-                        reBestCorrelation = FLT_MAX;
-                    }
-                }
-
-
-/*
-                if (std::abs(lag_to_y[secondBesｔLag - lagMin] - newPitch) > 0.025)
-                    newPitch2 = -1.0f;
-                if (std::abs(lag_to_y[thirdBesｔLag - lagMin] - newPitch) > 0.025)
-                    newPitch2 = -1.0f;
-                if (std::abs(lag_to_y[thirdBesｔLag - lagMin] - lag_to_y[secondBesｔLag - lagMin]) > 0.025)
-                    newPitch2 = -1.0f;
-*/
-                if (std::abs(newPitch - newPitch2) > 0.025)
-                    newPitch2 = -1.0f;
-
-                currentPitchRing[currentPitchWriteIndex] = newPitch2;
-
-//                prevLag = bestLag;
+#ifdef ENABLE_MIDI
+        if (midiOutput)
+            midiOutput->add(pitch, detector.rmsSQ, t);
+#endif
 
-                //std::cout << (std::abs(std::log2(prevNewPitch) - std::log2(newFirstPitch)) < abs(std::log2(prevNewPitch) - std::log2(newSecondPitch)))  << std::endl;
+        if (detector.sampleIndex % correlogramInterval == 0 && correlogramEnabled.load(std::memory_order_relaxed)) {
+            CorrelogramFrame& frame = correlogramBuffer.writeBuffer();
+            frame.sampleIndex = detector.sampleIndex;
+            detector.normalizedCorrelation(frame.correlation);
+            correlogramBuffer.publish();
+        }
 
+        if (firstPitchNs.load(std::memory_order_relaxed) == 0 && pitch != -1.0f)
+            firstPitchNs.store(monotonicNs(), std::memory_order_relaxed);
+        voiced += pitch != -1.0f;
 
-            }
-            size_t newWriteIndex = currentPitchWriteIndex.load(std::memory_order_relaxed) + 1;
-            if (newWriteIndex >= (size_t)sampleRate)
-                newWriteIndex -= (size_t)sampleRate;
-            currentPitchWriteIndex.store(newWriteIndex, std::memory_order_release);
-        }
-//        assert(memcmp(&previousSamples[0], audioData, numSamples*sizeof(float)) == 0);
+        pitchRing.push(pitch, pitchExperiment);
+    }
+    if (pitchShm)
+        pitchShm->wake();
+    PipelineMetrics::add(pipelineMetrics.samples, numSamples);
+    PipelineMetrics::add(pipelineMetrics.voicedSamples, voiced);
+    if (tracer) {
+        tracer->record(traceUpdate, traceStartNs, updateNs, numSamples);
+        tracer->record(tracePeakSearch, traceStartNs + updateNs, peakSearchNs, numSamples);
     }
-    pw_stream_queue_buffer(stream, buffer);
 }
 
-#include <spa/param/latency-utils.h>
-
-// Pipewireのパラメータ変更を受け取るコールバック関数
-static void on_param_changed([[maybe_unused]] void *data, uint32_t id, const struct spa_pod *params)
-{
-    switch (id) {
-        case SPA_PARAM_Latency: {
-            struct spa_latency_info latency;
+// ピッチを計算（音声の入力元が1ブロックごとに呼ぶ）
+static void on_process(const AudioBlock& block) {
+    uint64_t timingStart = callbackTiming.begin();
+    TraceScope traceScope(tracer.get(), traceOnProcess);
+    size_t numSamples = block.numSamples;
+    traceScope.args[0] = numSamples;
+    if (firstAudioNs.load(std::memory_order_relaxed) == 0)
+        firstAudioNs.store(monotonicNs(), std::memory_order_relaxed);
+    if (block.xrun)
+        PipelineMetrics::add(pipelineMetrics.xruns, 1);
+
+    if (chunkCapture)
+        chunkCapture->push(monotonicNs(), block.samples, numSamples);
+
+    if (overloadLadder)
+        overloadLadder->apply(detector);
+
+#ifdef ENABLE_MIDI
+    // イベントはこのコールバックの時刻にサンプルの位置を足した時刻に予約する
+    if (midiOutput)
+        midiOutput->begin(monotonicNs());
+#endif
+    processAudio(block.samples, numSamples);
+    PipelineMetrics::add(pipelineMetrics.callbacks, 1);
 
-            int res = spa_latency_parse(params, &latency);
+    // 収録時刻が分からない入力元では、コールバックの始まりから測る
+    if (latencyProbe)
+        latencyProbe->mark(LatencyMark{pitchRing.written(), block.captureNs ? block.captureNs : block.callbackNs, block.callbackNs, monotonicNs()});
 
-            if (res < 0) {
-                fprintf(stderr, "Failed to parse latency info: %d\n", res);
-                return;
-            }
-            printf("Latency Info:\n");
-            printf("  min_quantum: %f\n", latency.min_quantum); // ?
-            printf("  max_quantum: %f\n", latency.max_quantum); // ?
-            printf("  min_rate: %u\n", latency.min_rate); // same as jack_latency_range_t
-            printf("  max_rate: %u\n", latency.max_rate); // ditto
-            printf("  min_ns: %lu\n", latency.min_ns); // ?
-            printf("  max_ns: %lu\n", latency.max_ns); // ?
-            break;
-        }
-        default:
-            break;
+    double load = callbackTiming.end(timingStart, numSamples);
+    if (overloadLadder && overloadLadder->update(load, numSamples)) {
+        pipelineMetrics.degradationLevel.store(overloadLadder->currentLevel(), std::memory_order_relaxed);
+        PipelineMetrics::add(pipelineMetrics.degradationSteps, 1);
     }
-    // TODO: check "Pro Audio profile" or not
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+// 入力元の遅延の報告（PipeWire の param_changed か、ほかの入力元の open から）
+static void on_latency(const AudioLatency& latency) {
+    printf("Latency Info:\n");
+    printf("  min_quantum: %f\n", latency.minQuantum); // ?
+    printf("  max_quantum: %f\n", latency.maxQuantum); // ?
+    printf("  min_rate: %u\n", latency.minRate); // same as jack_latency_range_t
+    printf("  max_rate: %u\n", latency.maxRate); // ditto
+    printf("  min_ns: %lu\n", (unsigned long)latency.minNs); // ?
+    printf("  max_ns: %lu\n", (unsigned long)latency.maxNs); // ?
+    pipelineMetrics.latencyMinQuantum.store(latency.minQuantum, std::memory_order_relaxed);
+    pipelineMetrics.latencyMaxQuantum.store(latency.maxQuantum, std::memory_order_relaxed);
+    pipelineMetrics.latencyMinRate.store(latency.minRate, std::memory_order_relaxed);
+    pipelineMetrics.latencyMaxRate.store(latency.maxRate, std::memory_order_relaxed);
+    pipelineMetrics.latencyMinNs.store(latency.minNs, std::memory_order_relaxed);
+    pipelineMetrics.latencyMaxNs.store(latency.maxNs, std::memory_order_relaxed);
+    pipelineMetrics.latencyKnown.store(true, std::memory_order_relaxed);
+    if (tracer)
+        tracer->instant(traceLatency, latency.minRate, latency.maxRate, (uint32_t)std::min<uint64_t>(latency.maxNs, UINT32_MAX));
+}
+
+static void on_param_changed(uint32_t id) {
+    if (tracer)
+        tracer->instant(traceParamChanged, id);
+}
 
-// Pipewire のストリームイベント構造体
-static const struct pw_stream_events stream_events = {
-    PW_VERSION_STREAM_EVENTS,
-    .param_changed = on_param_changed,
-    .process = on_process,
+// ピッチを区間にまとめて GPU 側の履歴のリング（テクスチャバッファ）へ新しい区間だけを送る
+// 履歴は GPU 側にだけあり、CPU は新しい区間しか触らない
+HistoryBucketWriter bucketWriter;
+HistoryBucketWriter bucketWriter2;
+GLfloat filledBuckets[maxFilledBuckets*2];
+int viewportWidth = 800; // 列の数（フレームバッファの幅）
+GLuint vao, vbo, tex;
+GLuint vao2, vbo2, tex2;
+
+// GPU のリングより古いものまで遡れるように、同じピッチを粗い区間にまとめた長い履歴（pitch_archive.h）
+PitchArchive archive;
+PitchArchive archive2;
+
+// 描画スレッドがリングバッファから読み出したピッチ（1回に pitchBatchSamples まで）
+float historyPitch[pitchBatchSamples], historyPitchExperiment[pitchBatchSamples];
+uint64_t historySeq = 0; // 履歴に入れたピッチの数（次に入れる通し番号）
+
+// 長い履歴の表示範囲を列ごとにまとめたもの（表示範囲が GPU のリングに収まらないときだけ使う）
+std::vector<GLfloat> viewColumns; // 列ごとに (最小値, 最大値, 0, 有声の割合)
+GLuint columnsVbo[2], columnsTex[2];
+// columnsVbo に送った列の表示範囲と列の数とその時のサンプル数（同じなら作り直さない）
+struct ViewColumnsKey {
+    int64_t start = 0, end = 0;
+    size_t columns = 0;
+    uint64_t samples = 0;
+    bool operator==(const ViewColumnsKey& o) const { return start == o.start && end == o.end && columns == o.columns && samples == o.samples; }
 };
-#pragma GCC diagnostic pop
+ViewColumnsKey viewColumnsKey[2];
 
-const size_t maxHistory = 10 * (size_t)sampleRate; // 表示するサンプルの数（10秒分）
-std::vector<GLfloat> vertices(maxHistory*2);
-std::vector<GLfloat> vertices2(maxHistory*2);
-std::vector<GLuint> indices(maxHistory);
-std::vector<GLuint> indices2(maxHistory);
-GLuint vao, vbo, ebo;
-GLuint vao2, vbo2, ebo2;
+// 表示範囲（--history、ホイールでズーム、ドラッグと矢印キーでスクロール、End で最新へ）
+const uint64_t minViewSpan = (uint64_t)sampleRate / 4;          // 0.25秒
+const uint64_t maxViewSpan = 24 * 60 * 60 * (uint64_t)sampleRate; // 24時間
+uint64_t viewSpan = maxHistory; // 表示する長さ（サンプル数）
+bool viewLive = true;           // 右端を最新のピッチに合わせる
+uint64_t viewEnd = 0;           // viewLive でないときの右端（通しのサンプル番号）
 
 // 頂点シェーダー
+// 画素の列ごとに最小値と最大値の2頂点を作る。右端が newest から offset だけ前の区間で、左へ古くなる
+// 頂点の位置は頂点の番号と newest だけで決まるので、スクロールのために書き換えるものはない
+// 長い履歴を遡って見るときは、CPU が列ごとにまとめたもの（buckets == span == columns）を同じように描く
 const char* vertexShaderSource = R"(
     #version 330 core
-    layout (location = 0) in vec2 aPos;
+    uniform samplerBuffer history; // 区間ごとの (最小値, 最大値, -, 有声の割合) のリング（RG32F なら有声の割合は 1）
+    uniform int buckets;           // リングの区間の数
+    uniform int span;              // 表示する区間の数
+    uniform int offset;            // 右端の区間が newest からいくつ前か（span + offset は buckets 以下）
+    uniform int newest;            // 書き込み中の区間
+    uniform int columns;           // 列の数
+    noperspective out float gap;
+    noperspective out float voicing;
+
+    // 列 c に入る区間の最小値と最大値（有声の区間がなければ lo > hi）と有声の割合（CPU 側の PitchRange::merge と同じまとめ方）
+    void columnRange(int c, out float lo, out float hi, out float voiced) {
+        int first = span * c / columns;
+        int last = max(span * (c + 1) / columns, first + 1);
+        lo = 2.0;
+        hi = -2.0;
+        voiced = 0.0;
+        for (int age = first; age < last; age++) { // age は古い方からの順番
+            vec4 minMax = texelFetch(history, (newest + 1 + buckets - span - offset + age) % buckets);
+            lo = min(lo, minMax.x);
+            hi = max(hi, minMax.y);
+            voiced = max(voiced, minMax.a);
+        }
+    }
+
     void main() {
-        gl_Position = vec4(aPos, 0.0, 1.0);
+        int c = gl_VertexID / 2;
+        float lo, hi;
+        columnRange(c, lo, hi, voicing);
+
+        // 前の列の中央に近い方から描いて、列の間の線が縦の線をまたがないようにする
+        bool maxFirst = false;
+        if (c > 0) {
+            float prevLo, prevHi, prevVoiced;
+            columnRange(c - 1, prevLo, prevHi, prevVoiced);
+            float prevMid = (prevLo + prevHi) * 0.5;
+            maxFirst = prevLo <= prevHi && abs(prevMid - hi) < abs(prevMid - lo);
+        }
+        float y = ((gl_VertexID & 1) == 0) == maxFirst ? hi : lo;
+
+        gap = lo > hi ? 1.0 : 0.0;
+        gl_Position = vec4(-1.0 + 2.0 * (float(c) + 0.5) / float(columns), lo > hi ? -1.0 : y, 0.0, 1.0);
     }
 )";
 
-// フラグメントシェーダー
+// フラグメントシェーダー（gap の頂点につながる線は捨てる。有声の割合が小さい列は暗くする）
 const char* fragmentShaderSource = R"(
     #version 330 core
+    noperspective in float gap;
+    noperspective in float voicing;
     out vec4 FragColor;
     void main() {
-        FragColor = vec4(0.0, 1.0, 0.0, 0.0);
+        if (gap > 0.0)
+            discard;
+        FragColor = vec4(0.0, 1.0, 0.0, 0.0) * (0.4 + 0.6 * voicing);
     }
 )";
 const char* fragmentShaderSource2 = R"(
     #version 330 core
+    noperspective in float gap;
+    noperspective in float voicing;
+    out vec4 FragColor;
+    void main() {
+        if (gap > 0.0)
+            discard;
+        FragColor = vec4(0.0, 0.0, 1.0, 0.0) * (0.4 + 0.6 * voicing);
+    }
+)";
+
+// 基準線のシェーダー（頂点ごとに色を持つ）
+const char* noteGridVertexShaderSource = R"(
+    #version 330 core
+    layout (location = 0) in vec2 aPos;
+    layout (location = 1) in vec3 aColor;
+    out vec3 color;
+    void main() {
+        color = aColor;
+        gl_Position = vec4(aPos, 0.0, 1.0);
+    }
+)";
+const char* noteGridFragmentShaderSource = R"(
+    #version 330 core
+    in vec3 color;
     out vec4 FragColor;
     void main() {
-        FragColor = vec4(0.0, 0.0, 1zz.0, 0.0);
+        FragColor = vec4(color, 0.0);
+    }
+)";
+
+// コレログラムのシェーダー（画面全体を覆う三角形に、横を時間、縦をピッチの軸にして自己相関の強さを塗る）
+const char* correlogramVertexShaderSource = R"(
+    #version 330 core
+    out vec2 pos; // 画面の左下が (0, 0)、右上が (1, 1)
+    void main() {
+        pos = vec2((gl_VertexID & 1) * 2, (gl_VertexID >> 1) * 2);
+        gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);
+    }
+)";
+const char* correlogramFragmentShaderSource = R"(
+    #version 330 core
+    uniform sampler2D correlogram; // 横が lag - lagMin、縦が行（時間）のリング
+    uniform int newestRow;         // 最も新しい行（右端）
+    uniform int rows;
+    uniform int visibleRows;       // 表示する行の数（ピッチの線の span に合わせる）
+    uniform float lagMin;
+    uniform float lags;
+    uniform float sampleRate;
+    uniform float baseFrequency;
+    uniform float maxDisplayPitch;
+    in vec2 pos;
+    out vec4 FragColor;
+    void main() {
+        int row = (newestRow + 1 + rows - visibleRows + int(pos.x * float(visibleRows))) % rows;
+        // y 座標はピッチの線と同じ対数の軸
+        float lag = sampleRate / (baseFrequency * exp2(pos.y * log2(maxDisplayPitch / baseFrequency)));
+        float v = clamp(texture(correlogram, vec2((lag - lagMin + 0.5) / lags, (float(row) + 0.5) / float(rows))).r, 0.0, 1.0);
+        // 黒から紫、橙、黄へ（基準線とピッチの線が見えるように暗めにする）
+        vec3 color = vec3(smoothstep(0.1, 0.7, v), smoothstep(0.5, 1.0, v) * 0.8, 0.5 * v * (1.0 - v));
+        FragColor = vec4(color * 0.6, 0.0);
     }
 )";
 
 GLuint shaderProgram = 0;
 GLuint shaderProgram2 = 0;
+GLuint noteGridProgram = 0;
+GLuint correlogramProgram = 0;
+
+// 基準線の頂点バッファと、それを作ったときの音程の範囲
+GLuint noteGridVao, noteGridVbo;
+GLsizei noteGridVertexCount = 0;
+float noteGridBaseFrequency = 0.0f, noteGridMaxDisplayPitch = 0.0f;
+
+// uniform の場所（i == 0 が shaderProgram, i == 1 が shaderProgram2）
+GLint newestLocations[2], columnsLocations[2], bucketsLocations[2], spanLocations[2], offsetLocations[2];
+GLint newestRowLocation, visibleRowsLocation; // correlogramProgram
+
+GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cerr << "Shader compilation failed: " << log << std::endl;
+    }
+    return shader;
+}
 
-void createShaderProgram() {
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, nullptr);
-    glCompileShader(vertexShader);
+GLuint linkProgram(GLuint vertexShader, GLuint fragmentShader) {
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glLinkProgram(program);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::cerr << "Shader program link failed: " << log << std::endl;
+    }
+    return program;
+}
 
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, nullptr);
-    glCompileShader(fragmentShader);
+void createShaderProgram() {
+    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexShaderSource);
+    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentShaderSource);
+    GLuint fragmentShader2 = compileShader(GL_FRAGMENT_SHADER, fragmentShaderSource2);
 
-    GLuint fragmentShader2 = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader2, 1, &fragmentShaderSource2, nullptr);
-    glCompileShader(fragmentShader2);
+    shaderProgram = linkProgram(vertexShader, fragmentShader);
+    shaderProgram2 = linkProgram(vertexShader, fragmentShader2);
 
-    shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
+    GLuint noteGridVertexShader = compileShader(GL_VERTEX_SHADER, noteGridVertexShaderSource);
+    GLuint noteGridFragmentShader = compileShader(GL_FRAGMENT_SHADER, noteGridFragmentShaderSource);
+    noteGridProgram = linkProgram(noteGridVertexShader, noteGridFragmentShader);
 
-    shaderProgram2 = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader2);
-    glLinkProgram(shaderProgram);
+    GLuint correlogramVertexShader = compileShader(GL_VERTEX_SHADER, correlogramVertexShaderSource);
+    GLuint correlogramFragmentShader = compileShader(GL_FRAGMENT_SHADER, correlogramFragmentShaderSource);
+    correlogramProgram = linkProgram(correlogramVertexShader, correlogramFragmentShader);
 
     glDeleteShader(vertexShader);
     glDeleteShader(fragmentShader);
     glDeleteShader(fragmentShader2);
+    glDeleteShader(noteGridVertexShader);
+    glDeleteShader(noteGridFragmentShader);
+    glDeleteShader(correlogramVertexShader);
+    glDeleteShader(correlogramFragmentShader);
+
+    glUseProgram(correlogramProgram);
+    glUniform1i(glGetUniformLocation(correlogramProgram, "correlogram"), 0);
+    glUniform1i(glGetUniformLocation(correlogramProgram, "rows"), correlogramRows);
+    glUniform1f(glGetUniformLocation(correlogramProgram, "lagMin"), lagMin);
+    glUniform1f(glGetUniformLocation(correlogramProgram, "lags"), lagMax - lagMin);
+    glUniform1f(glGetUniformLocation(correlogramProgram, "sampleRate"), sampleRate);
+    glUniform1f(glGetUniformLocation(correlogramProgram, "baseFrequency"), baseFrequency);
+    glUniform1f(glGetUniformLocation(correlogramProgram, "maxDisplayPitch"), maxDisplayPitch);
+    newestRowLocation = glGetUniformLocation(correlogramProgram, "newestRow");
+    visibleRowsLocation = glGetUniformLocation(correlogramProgram, "visibleRows");
+
+    GLuint programs[2] = {shaderProgram, shaderProgram2};
+    for (int i = 0; i < 2; i++) {
+        glUseProgram(programs[i]);
+        glUniform1i(glGetUniformLocation(programs[i], "history"), 0);
+        newestLocations[i] = glGetUniformLocation(programs[i], "newest");
+        columnsLocations[i] = glGetUniformLocation(programs[i], "columns");
+        bucketsLocations[i] = glGetUniformLocation(programs[i], "buckets");
+        spanLocations[i] = glGetUniformLocation(programs[i], "span");
+        offsetLocations[i] = glGetUniformLocation(programs[i], "offset");
+    }
 }
 
+// フレームのペース配分（--fps, --no-vsync, --idle-fps）
+// 新しいピッチか入力があったときだけ、最大 targetFps で描画する
+double targetFps = 0.0; // 0 ならモニタのリフレッシュレート
+bool vsync = true;
+double idleFps = 5.0; // 有声のピッチが idleDelay 秒来ないときのフレームレート（0 なら落とさない）
+const double idleDelay = 1.0;
+bool redrawRequested = true; // 入力やリサイズで新しいピッチがなくても描画する
+
 void framebuffer_size_callback([[maybe_unused]] GLFWwindow* window, int width, int height) {
     glViewport(0, 0, width, height);  // OpenGLのビューポートを更新
+    viewportWidth = width;
+    redrawRequested = true;
 
 //    int fbWidth, fbHeight;
 //    glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
@@ -435,33 +575,330 @@ void toggleFullscreen(GLFWwindow* window) {
     isFullscreen = !isFullscreen;
 }
 
+// 表示範囲の右端（通しのサンプル番号）
+uint64_t viewRight() {
+    return viewLive ? archive.samples() : viewEnd;
+}
+
+// 右端を end に動かす（最新を越えたら最新に合わせ続け、最初のピッチより前には行かない）
+void moveView(int64_t end) {
+    uint64_t newest = archive.samples();
+    if (end >= (int64_t)newest) {
+        viewLive = true;
+    } else {
+        viewLive = false;
+        viewEnd = std::max<int64_t>(end, std::min(viewSpan, newest));
+    }
+}
+
+// 画面の x（左端 0、右端 1）の時刻を動かさずに、表示する長さを factor 倍にする（最新に合わせているときは右端のまま）
+void zoomView(double factor, double x) {
+    double anchor = viewRight() - viewSpan * (1.0 - x);
+    viewSpan = std::clamp<uint64_t>(std::llround(viewSpan * factor), minViewSpan, maxViewSpan);
+    if (!viewLive)
+        moveView(std::llround(anchor + viewSpan * (1.0 - x)));
+}
+
+// 表示範囲を samples だけ過去へ（負なら未来へ）動かす
+void panView(double samples) {
+    moveView((int64_t)viewRight() - std::llround(samples));
+}
+
+// ホイールでカーソルの位置を中心にズームする
+void scroll_callback(GLFWwindow* window, [[maybe_unused]] double xoffset, double yoffset) {
+    double cursorX, cursorY;
+    int width, height;
+    glfwGetCursorPos(window, &cursorX, &cursorY);
+    glfwGetWindowSize(window, &width, &height);
+    zoomView(std::pow(0.8, yoffset), width > 0 ? std::clamp(cursorX / width, 0.0, 1.0) : 1.0);
+    redrawRequested = true;
+}
+
+// 左ボタンでドラッグしてスクロールする
+bool dragging = false;
+double dragX = 0.0;
+
+void mouse_button_callback(GLFWwindow* window, int button, int action, [[maybe_unused]] int mods) {
+    if (button != GLFW_MOUSE_BUTTON_LEFT)
+        return;
+    dragging = action == GLFW_PRESS;
+    double cursorY;
+    glfwGetCursorPos(window, &dragX, &cursorY);
+}
+
+void cursor_pos_callback(GLFWwindow* window, double x, [[maybe_unused]] double y) {
+    if (!dragging)
+        return;
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    if (width > 0)
+        panView((x - dragX) * viewSpan / width); // 右へドラッグすると過去が見える
+    dragX = x;
+    redrawRequested = true;
+}
+
+// ウインドウの再描画が必要になったときのコールバック関数
+void window_refresh_callback([[maybe_unused]] GLFWwindow* window) {
+    redrawRequested = true;
+}
+
 // キーボード入力のコールバック関数
 void key_callback(GLFWwindow* window, int key, [[maybe_unused]] int scancode, int action, [[maybe_unused]] int mods) {
+    redrawRequested = true;
     if (key == GLFW_KEY_F11 && action == GLFW_PRESS) {
         toggleFullscreen(window);
+    } else if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+        correlogramEnabled = !correlogramEnabled; // C でコレログラムの表示を切り替える
+    } else if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+        timingOverlay = !timingOverlay; // T で処理時間のヒストグラムの表示を切り替える
+    } else if (action != GLFW_RELEASE && (key == GLFW_KEY_LEFT || key == GLFW_KEY_RIGHT)) {
+        panView((key == GLFW_KEY_LEFT ? 0.25 : -0.25) * viewSpan); // 矢印キーで表示の 1/4 ずつスクロール
+    } else if (action != GLFW_RELEASE && (key == GLFW_KEY_UP || key == GLFW_KEY_DOWN)) {
+        zoomView(key == GLFW_KEY_UP ? 0.8 : 1.25, 1.0);
+    } else if (key == GLFW_KEY_END && action == GLFW_PRESS) {
+        viewLive = true; // End で最新に戻る
     } else if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
         glfwSetWindowShouldClose(window, true); // ESCでウィンドウを閉じる
     }
 }
 
+// 履歴のリング（区間ごとの最小値と最大値のテクスチャバッファ、最初はすべて空の区間）と、頂点属性のない VAO を作る
+void createHistoryBuffers(GLuint& vao, GLuint& vbo, GLuint& tex) {
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+    glGenTextures(1, &tex);
+
+    std::vector<GLfloat> empty(historyBuckets * 2);
+    for (size_t b = 0; b < historyBuckets; b++) {
+        empty[b*2 + 0] = bucketEmptyMin;
+        empty[b*2 + 1] = bucketEmptyMax;
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, vbo);
+    glBufferData(GL_TEXTURE_BUFFER, empty.size() * sizeof(GLfloat), empty.data(), GL_DYNAMIC_DRAW);
+
+    glBindTexture(GL_TEXTURE_BUFFER, tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32F, vbo);
+}
+
+// 区間 first から count 個（折り返しあり）の最小値と最大値をリングへ送る
+void uploadBuckets(GLuint vbo, const GLfloat* minMax, size_t first, size_t count) {
+    glBindBuffer(GL_TEXTURE_BUFFER, vbo);
+    while (count > 0) {
+        size_t n = std::min(count, historyBuckets - first);
+        glBufferSubData(GL_TEXTURE_BUFFER, first * 2 * sizeof(GLfloat), n * 2 * sizeof(GLfloat), minMax);
+        minMax += n * 2;
+        count -= n;
+        first = 0;
+    }
+}
+
+// コレログラムのテクスチャ（1行が1回分の自己相関）と、行を送るための2つの PBO
+GLuint correlogramVao, correlogramTex;
+GLuint correlogramPbos[2];
+size_t correlogramPboIndex = 0;
+uint64_t correlogramLastRow = UINT64_MAX; // 最後に書いた行の通し番号（UINT64_MAX ならまだない）
+bool correlogramShown = false;
+
+// 処理時間のヒストグラムの頂点バッファ（基準線と同じシェーダーで描く）
+GLuint timingVao, timingVbo;
+
+// --latency：印のあるフレームのスワップの後に GPU のタイムスタンプを置き、数フレーム後に待たずに結果を読む
+const size_t latencyQueries = 8;
+GLuint latencyQueryIds[latencyQueries];
+struct PendingLatencyFrame {
+    LatencyFrame frame;
+    std::vector<LatencyMark> marks;
+} latencyPending[latencyQueries];
+size_t latencyPendingFirst = 0, latencyPendingCount = 0;
+int64_t gpuClockOffsetNs = 0; // CLOCK_MONOTONIC から GPU の時刻を引いたもの
+
+// GPU の時刻を CLOCK_MONOTONIC に合わせる（ずれていくので1秒ごとに測り直す）
+void calibrateGpuClock() {
+    uint64_t before = monotonicNs();
+    GLint64 gpuNs = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuNs);
+    uint64_t after = monotonicNs();
+    gpuClockOffsetNs = (int64_t)(before + (after - before) / 2) - gpuNs;
+}
+
+void createCorrelogram() {
+    const size_t lags = lagMax - lagMin;
+    glGenVertexArrays(1, &correlogramVao);
+
+    glGenTextures(1, &correlogramTex);
+    glBindTexture(GL_TEXTURE_2D, correlogramTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, lags, correlogramRows, 0, GL_RED, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenBuffers(2, correlogramPbos);
+    for (GLuint pbo : correlogramPbos) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, correlogramRows * lags * sizeof(GLfloat), nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+// 新しい自己相関があれば、前に書いた行の次からその行までを PBO 経由でテクスチャへ送る
+// （描画が間に合わなかった行は同じ自己相関で埋める）
+void updateCorrelogram() {
+    const size_t lags = lagMax - lagMin;
+
+    if (!correlogramShown) { // 表示し始めたら前の内容を消す
+        std::vector<GLfloat> zeros(correlogramRows * lags, 0.0f);
+        glBindTexture(GL_TEXTURE_2D, correlogramTex);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, lags, correlogramRows, GL_RED, GL_FLOAT, zeros.data());
+        correlogramLastRow = UINT64_MAX;
+        correlogramShown = true;
+    }
+    if (!correlogramBuffer.update())
+        return;
+    const CorrelogramFrame& frame = correlogramBuffer.readBuffer();
+    uint64_t row = frame.sampleIndex / correlogramInterval;
+    if (correlogramLastRow != UINT64_MAX && row <= correlogramLastRow)
+        return;
+    size_t count = correlogramLastRow == UINT64_MAX ? 1 : std::min<uint64_t>(row - correlogramLastRow, correlogramRows);
+    correlogramLastRow = row;
+
+    // 前のフレームで使った PBO からの転送を待たないように、2つを交互に使う
+    TraceScope traceScope(tracer.get(), traceMap);
+    traceScope.args[0] = count;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, correlogramPbos[correlogramPboIndex]);
+    correlogramPboIndex ^= 1;
+    GLfloat* mapped = (GLfloat*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, count * lags * sizeof(GLfloat),
+                                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (mapped) {
+        for (size_t i = 0; i < count; i++)
+            memcpy(mapped + i * lags, frame.correlation, lags * sizeof(GLfloat));
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        glBindTexture(GL_TEXTURE_2D, correlogramTex);
+        size_t first = (row + 1 - count) % correlogramRows;
+        size_t n = std::min(count, correlogramRows - first);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, lags, n, GL_RED, GL_FLOAT, (void*)0);
+        if (n < count)
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, lags, count - n, GL_RED, GL_FLOAT, (void*)(n * lags * sizeof(GLfloat)));
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+// コレログラムは最近の10秒分しかないので、最新に合わせて10秒以内を表示しているときだけ描く（表示しなくても行は送る）
+void renderCorrelogram() {
+    if (!correlogramEnabled.load(std::memory_order_relaxed)) {
+        correlogramShown = false;
+        return;
+    }
+    updateCorrelogram();
+    if (correlogramLastRow == UINT64_MAX || !viewLive || viewSpan > maxHistory)
+        return;
+
+    glUseProgram(correlogramProgram);
+    glUniform1i(newestRowLocation, correlogramLastRow % correlogramRows);
+    glUniform1i(visibleRowsLocation,
+                std::max<size_t>(correlogramRows * viewSpan / maxHistory, 1));
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, correlogramTex);
+    glBindVertexArray(correlogramVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+// シェーダーと、履歴、コレログラム、基準線の GPU 側の領域を作る（ウインドウでもオフスクリーンでも共通）
+void createRenderer() {
+    createShaderProgram();
+
+    createHistoryBuffers(vao, vbo, tex);
+    createHistoryBuffers(vao2, vbo2, tex2);
+    createCorrelogram();
+
+    // 長い履歴の表示範囲の列（中身は描くたびに送る）
+    glGenBuffers(2, columnsVbo);
+    glGenTextures(2, columnsTex);
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_TEXTURE_BUFFER, columnsVbo[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 4 * sizeof(GLfloat), nullptr, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, columnsTex[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, columnsVbo[i]);
+    }
+
+    // 基準線の頂点バッファ（中身は最初の renderNotes で作る）
+    glGenVertexArrays(1, &noteGridVao);
+    glGenBuffers(1, &noteGridVbo);
+    glBindVertexArray(noteGridVao);
+    glBindBuffer(GL_ARRAY_BUFFER, noteGridVbo);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (void*)(2 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(1);
+
+    // 処理時間のヒストグラムの頂点バッファ（中身は描く度に作る）
+    glGenVertexArrays(1, &timingVao);
+    glGenBuffers(1, &timingVbo);
+    glBindVertexArray(timingVao);
+    glBindBuffer(GL_ARRAY_BUFFER, timingVbo);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), (void*)(2 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(1);
+
+    if (latencyProbe) {
+        glGenQueries(latencyQueries, latencyQueryIds);
+        calibrateGpuClock();
+    }
+
+    glUseProgram(shaderProgram);
+}
+
+void destroyRenderer() {
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &vbo);
+    glDeleteTextures(1, &tex);
+    glDeleteVertexArrays(1, &vao2);
+    glDeleteBuffers(1, &vbo2);
+    glDeleteTextures(1, &tex2);
+    glDeleteProgram(shaderProgram);
+    glDeleteProgram(shaderProgram2);
+    glDeleteVertexArrays(1, &noteGridVao);
+    glDeleteBuffers(1, &noteGridVbo);
+    glDeleteProgram(noteGridProgram);
+    glDeleteVertexArrays(1, &timingVao);
+    glDeleteBuffers(1, &timingVbo);
+    if (latencyProbe)
+        glDeleteQueries(latencyQueries, latencyQueryIds);
+    glDeleteVertexArrays(1, &correlogramVao);
+    glDeleteTextures(1, &correlogramTex);
+    glDeleteBuffers(2, correlogramPbos);
+    glDeleteProgram(correlogramProgram);
+    glDeleteBuffers(2, columnsVbo);
+    glDeleteTextures(2, columnsTex);
+}
+
 // OpenGL の初期化（GLFW ウィンドウの作成）
 void initOpenGL(GLFWwindow** window) {
     if (!glfwInit()) {
         std::cerr << "GLFW initialization failed. exit." << std::endl;
         exit(EXIT_FAILURE);
     }
+    glfwReadyNs = monotonicNs();
+    // 固定機能は使わないので core profile を要求する
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     *window = glfwCreateWindow(800, 600, "Vocal Pitch Visualizer", nullptr, nullptr);
     if (!*window) {
         std::cerr << "GLFW window creation failed. exit." << std::endl;
         glfwTerminate();
         exit(EXIT_FAILURE);
     }
+    windowReadyNs = monotonicNs();
     glfwMakeContextCurrent(*window);
     glewExperimental = GL_TRUE;
     if (glewInit() != GLEW_OK) {
         std::cerr << "GLEW initialization failed. exit." << std::endl;
         exit(EXIT_FAILURE);
     }
+    glGetError(); // core profile では glewInit が GL_INVALID_ENUM を残すことがあるので消しておく
 
 /*
     // 線のスムーシングを有効にする
@@ -472,152 +909,697 @@ void initOpenGL(GLFWwindow** window) {
 */
 
     glfwSetFramebufferSizeCallback(*window, framebuffer_size_callback); // ウインドウリサイズのコールバックを登録
+    int fbHeight;
+    glfwGetFramebufferSize(*window, &viewportWidth, &fbHeight);
     glfwSetKeyCallback(*window, key_callback); // キー入力のコールバックを登録
+    glfwSetWindowRefreshCallback(*window, window_refresh_callback); // 再描画のコールバックを登録
+    glfwSetScrollCallback(*window, scroll_callback); // ズーム
+    glfwSetMouseButtonCallback(*window, mouse_button_callback); // ドラッグでスクロール
+    glfwSetCursorPosCallback(*window, cursor_pos_callback);
+
+    glfwSwapInterval(vsync ? 1 : 0);
+    if (targetFps <= 0.0) {
+        GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+        const GLFWvidmode* mode = monitor ? glfwGetVideoMode(monitor) : nullptr;
+        targetFps = mode && mode->refreshRate > 0 ? mode->refreshRate : 60.0;
+    }
+    std::cout << "Rendering at up to " << targetFps << " fps when new pitch arrives (vsync " << (vsync ? "on" : "off");
+    if (idleFps > 0.0)
+        std::cout << ", " << idleFps << " fps after " << idleDelay << " s without voice";
+    std::cout << ")" << std::endl;
 
-    createShaderProgram();
-
-    glEnable(GL_PRIMITIVE_RESTART);
-    glPrimitiveRestartIndex(0xFFFF);  // 使わないインデックスを設定
-
-    glGenVertexArrays(1, &vao);
-    glGenBuffers(1, &vbo);
-    glGenBuffers(1, &ebo);
-
-    glBindVertexArray(vao);
-
-    // 頂点バッファ
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
-    // インデックスバッファ
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
-    // 頂点属性
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), (void*)0);
-    glEnableVertexAttribArray(0);
-
-
-    glGenVertexArrays(1, &vao2);
-    glGenBuffers(1, &vbo2);
-    glGenBuffers(1, &ebo2);
-
-    glBindVertexArray(vao2);
- 
-    glBindBuffer(GL_ARRAY_BUFFER, vbo2);
-    glBufferData(GL_ARRAY_BUFFER, vertices2.size() * sizeof(GLfloat), vertices2.data(), GL_STATIC_DRAW);
-    // インデックスバッファ
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo2);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices2.size() * sizeof(GLuint), indices2.data(), GL_STATIC_DRAW);
-    // 頂点属性
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), (void*)0);
-    glEnableVertexAttribArray(0);
-
-    glUseProgram(shaderProgram);
+    createRenderer();
+    glReadyNs = monotonicNs();
 }
 
-void renderNotes(float baseFrequency, float maxDisplayPitch) {
+// 半音ごとの基準線を頂点バッファに作る（音程の範囲が変わったときだけ作り直す）
+void buildNoteGrid(float baseFrequency, float maxDisplayPitch) {
+    std::vector<GLfloat> gridVertices; // x, y, r, g, b
 
     for (int semitone = 0; semitone <= 48; ++semitone) {
         // 音程周波数を算出
         float freq = calculateNoteFrequency(baseFrequency, semitone);
-        if (semitone % 12 == 0) glColor3f(1.0f, 1.0f, 1.0f); // 白色で基準線を描画
-        else if (semitone % 12 == 1) glColor3f(1.0f, 0.0f, 0.0f); // 赤色で基準線を描画
+        // オクターブごとに白色、それ以外は赤色で基準線を描画
+        float g = semitone % 12 == 0 ? 1.0f : 0.0f;
 
         // 周波数が表示範囲内であれば対応するy軸の位置を計算して描画
         if (freq <= maxDisplayPitch) {
             float y = -1.0f + 2.0f * (std::log2(freq/baseFrequency) / std::log2(maxDisplayPitch / baseFrequency)); // 横軸に音程を対応させる
-            glBegin(GL_LINES);
-            glVertex2f(-1.0f, y);  // x は左端
-            glVertex2f( 1.0f, y);   // x は右端
-            glEnd();
+            gridVertices.insert(gridVertices.end(), {-1.0f, y, 1.0f, g, g}); // x は左端
+            gridVertices.insert(gridVertices.end(), { 1.0f, y, 1.0f, g, g}); // x は右端
         }
     }
+
+    glBindVertexArray(noteGridVao);
+    glBindBuffer(GL_ARRAY_BUFFER, noteGridVbo);
+    glBufferData(GL_ARRAY_BUFFER, gridVertices.size() * sizeof(GLfloat), gridVertices.data(), GL_STATIC_DRAW);
+    noteGridVertexCount = gridVertices.size() / 5;
+    noteGridBaseFrequency = baseFrequency;
+    noteGridMaxDisplayPitch = maxDisplayPitch;
 }
 
-// OpenGL のレンダリングループ（x方向は時間軸、y方向はピッチ）
-void renderLoop(GLFWwindow* window) {
-    size_t histIndex = 0;
-    size_t histIndex2 = 0;
-
-    while (!glfwWindowShouldClose(window)) {
-//        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        //float pitchx = currentPitchRing[currentPitchReadIndex].load();
-        //std::cout << "Reading from currentPitchRing[" << currentPitchReadIndex << "]: " << pitchx << std::endl;
-
-        glUseProgram(0);
-        // 基準線を描画
-        renderNotes(baseFrequency, maxDisplayPitch); 
-
-        for (int i = 1; i >= 0; i--){
-            float* buf = nullptr;
-            size_t *idx = nullptr, *hidx = nullptr;
-            if (i == 0) {
-                glBindVertexArray(vao); 
-                glBindBuffer(GL_ARRAY_BUFFER, vbo);
-                /*glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);*/
-                glUseProgram(shaderProgram); glColor3f(0.0f, 1.0f, 0.0f); buf = &currentPitchRing[0]; idx = &currentPitchReadIndex; hidx = &histIndex;
-            } else {
-                glBindVertexArray(vao2);
-                glBindBuffer(GL_ARRAY_BUFFER, vbo2);
-                /*glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo2); */
-                glUseProgram(shaderProgram2);
-                glColor3f(0.0f, 0.0f, 1.0f);
-                buf = &currentPitchRingExperiment[0];
-                idx = &currentPitchReadIndex2;
-                hidx = &histIndex2;
-            }
-            GLfloat* mappedVbo = (GLfloat*)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);  // バッファをマッピングして書き込み可能にする
-            GLuint* mappedEbo = (GLuint*)glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
-
-            mappedEbo[*hidx] = *hidx; // 前回の接続線を再接続
-
-            while (*idx != currentPitchWriteIndex) {
-                // 現在のピッチ値を取得（音量が小さい場合、-1が格納されている）
-                float pitch_y = buf[*idx];
-                (*idx)++;
-                if (*idx >= (size_t)sampleRate)
-                    *idx -= (size_t)sampleRate;
-
-                // vboにx座標を入れる
-                mappedVbo[(*hidx)*2 + 0] = -1.0f + 2.0f * (float(*hidx) / (maxHistory - 1));
-                // vboにy座標を入れる
-                // y軸は 0Hz -> -1, maxDisplayPitch -> 1　の対数マッピング
-//                mappedVbo[*hidx*2 + 1] = pitch_log2 == -1 ? -1 : (((std::log2(sampleRate) - pitch_log2 - std::log2(baseFrequency)) / std::log2(maxDisplayPitch / baseFrequency)) * 2.0f - 1.0f);
-                mappedVbo[(*hidx)*2 + 1] = pitch_y == -1 ? -1 : pitch_y * 2.0f - 1.0f;
-                if (pitch_y == -1.0f) mappedEbo[*hidx] = 0xFFFF; 
-                else mappedEbo[*hidx] = *hidx;
-                (*hidx)++;
-                if (*hidx >= maxHistory) (*hidx) -= maxHistory;
+void renderNotes(float baseFrequency, float maxDisplayPitch) {
+    if (baseFrequency != noteGridBaseFrequency || maxDisplayPitch != noteGridMaxDisplayPitch)
+        buildNoteGrid(baseFrequency, maxDisplayPitch);
+
+    glUseProgram(noteGridProgram);
+    glBindVertexArray(noteGridVao);
+    glDrawArrays(GL_LINES, 0, noteGridVertexCount);
+}
+
+// 続きのピッチを区間にまとめて、GPU のリングには変わった区間だけを送り、長い履歴にも足す
+static void addHistory(const float* pitch, const float* pitchExperiment, size_t numSamples) {
+    size_t firstBucket, count;
+    count = bucketWriter.fill(pitch, numSamples, filledBuckets, firstBucket);
+    uploadBuckets(vbo, filledBuckets, firstBucket, count);
+    count = bucketWriter2.fill(pitchExperiment, numSamples, filledBuckets, firstBucket);
+    uploadBuckets(vbo2, filledBuckets, firstBucket, count);
+
+    archive.add(pitch, numSamples);
+    archive2.add(pitchExperiment, numSamples);
+    historySeq += numSamples;
+}
+
+// リングバッファの新しいピッチをすべて履歴に入れる（有声のものがあれば true）
+// 描画が遅れて上書きされた分は、読んだ先頭の通し番号との差だけ無音として時間を進める
+bool updateHistory() {
+    static const std::vector<float> silence(pitchBatchSamples, -1.0f);
+    bool voiced = false;
+    uint64_t firstSeq;
+    size_t count;
+    TraceScope traceScope(tracer.get(), traceFill);
+    while ((count = pitchRing.read(historyPitch, historyPitchExperiment, pitchBatchSamples, firstSeq)) > 0) {
+        traceScope.args[0] += count;
+        while (historySeq < firstSeq) {
+            size_t n = std::min<uint64_t>(firstSeq - historySeq, pitchBatchSamples);
+            addHistory(silence.data(), silence.data(), n);
+        }
+        addHistory(historyPitch, historyPitchExperiment, count);
+        voiced = voiced || std::any_of(historyPitch, historyPitch + count, [](float y) { return y != -1.0f; });
+    }
+    return voiced;
+}
+
+// 1フレームを描画する（新しいピッチを送ってから、コレログラム、基準線、ピッチの線の順）
+void renderFrame() {
+    updateHistory();
+
+//    glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // コレログラムを背景に描画
+    renderCorrelogram();
+
+    // 基準線を描画
+    renderNotes(baseFrequency, maxDisplayPitch); 
+
+    // 表示は画素の列ごとに2頂点なので、描画の量は履歴の長さによらない
+    size_t columns = std::max(viewportWidth, 1);
+
+    // 表示範囲が GPU のリング（最近の10秒）に収まればそこから描き、収まらなければ長い履歴を列ごとにまとめて送る
+    // リングの区間の番号は、通しのサンプル番号を historyBucketSamples で割って historyBuckets で折り返したもの
+    uint64_t newest = archive.samples();
+    uint64_t end = viewRight();
+    uint64_t spanBuckets = std::max<uint64_t>(viewSpan / historyBucketSamples, 1);
+    uint64_t offsetBuckets = viewLive ? 0 : newest / historyBucketSamples - end / historyBucketSamples;
+    bool inRing = spanBuckets + offsetBuckets <= historyBuckets;
+
+    for (int i = 1; i >= 0; i--){
+        glBindVertexArray(i == 0 ? vao : vao2);
+        glUseProgram(i == 0 ? shaderProgram : shaderProgram2);
+        if (inRing) {
+            glBindTexture(GL_TEXTURE_BUFFER, i == 0 ? tex : tex2);
+            glUniform1i(bucketsLocations[i], historyBuckets);
+            glUniform1i(spanLocations[i], spanBuckets);
+            glUniform1i(offsetLocations[i], offsetBuckets);
+            glUniform1i(newestLocations[i], (i == 0 ? bucketWriter : bucketWriter2).bucket);
+        } else {
+            // 表示範囲もピッチも変わらなければ前に送った列をそのまま描く
+            ViewColumnsKey key{(int64_t)end - (int64_t)viewSpan, (int64_t)end, columns, newest};
+            if (!(key == viewColumnsKey[i])) {
+                viewColumns.resize(columns * 4);
+                (i == 0 ? archive : archive2).buildColumns(key.start, key.end, columns, viewColumns.data());
+                glBindBuffer(GL_TEXTURE_BUFFER, columnsVbo[i]);
+                glBufferData(GL_TEXTURE_BUFFER, viewColumns.size() * sizeof(GLfloat), viewColumns.data(), GL_STREAM_DRAW);
+                viewColumnsKey[i] = key;
             }
+            glBindTexture(GL_TEXTURE_BUFFER, columnsTex[i]);
+            glUniform1i(bucketsLocations[i], columns);
+            glUniform1i(spanLocations[i], columns);
+            glUniform1i(offsetLocations[i], 0);
+            glUniform1i(newestLocations[i], columns - 1);
+        }
+        glUniform1i(columnsLocations[i], columns);
+        glDrawArrays(GL_LINE_STRIP, 0, columns * 2);
+    }
+}
 
-            mappedEbo[*hidx] = 0xFFFF; // 接続線を切る
+// 最も多く来たバッファの長さの処理時間のヒストグラムを左下に描く
+// 横軸は締め切りの 0〜200%（白の縦線が締め切り）、縦軸は回数の対数。締め切りの半分までは緑、締め切りまでは黄、超えたら赤
+void renderTimingOverlay() {
+    int busiest = callbackTiming.busiest();
+    if (busiest < 0)
+        return;
+    const CallbackTiming::Quantum& q = callbackTiming.quantum(busiest);
+    const float left = -0.98f, bottom = -0.98f, width = 0.6f, height = 0.4f;
+    uint64_t maxCount = 1;
+    for (size_t b = 0; b <= timingBins; b++)
+        maxCount = std::max<uint64_t>(maxCount, q.bins[b].load(std::memory_order_relaxed));
+
+    std::vector<GLfloat> vertices; // x, y, r, g, b
+    vertices.reserve((timingBins + 5) * 10);
+    for (size_t b = 0; b <= timingBins; b++) {
+        uint64_t count = q.bins[b].load(std::memory_order_relaxed);
+        if (count == 0)
+            continue;
+        float x = left + width * (b + 0.5f) / (timingBins + 1);
+        float y = bottom + height * std::log1p((float)count) / std::log1p((float)maxCount);
+        float r = b < timingBins / 4 ? 0.0f : 1.0f, g = b < timingBins / 2 ? 1.0f : 0.0f;
+        vertices.insert(vertices.end(), {x, bottom, r, g, 0.0f, x, y, r, g, 0.0f});
+    }
+    float deadline = left + width * (timingBins / 2 + 0.5f) / (timingBins + 1);
+    vertices.insert(vertices.end(), {deadline, bottom, 1.0f, 1.0f, 1.0f, deadline, bottom + height, 1.0f, 1.0f, 1.0f});
+    vertices.insert(vertices.end(), {left, bottom, 0.5f, 0.5f, 0.5f, left + width, bottom, 0.5f, 0.5f, 0.5f});
+
+    // 後ろの基準線とピッチを消す
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(viewport[0] + (GLint)((left + 1.0f) / 2.0f * viewport[2]), viewport[1] + (GLint)((bottom + 1.0f) / 2.0f * viewport[3]),
+              (GLint)(width / 2.0f * viewport[2]) + 1, (GLint)(height / 2.0f * viewport[3]) + 1);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+
+    glUseProgram(noteGridProgram);
+    glBindVertexArray(timingVao);
+    glBindBuffer(GL_ARRAY_BUFFER, timingVbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STREAM_DRAW);
+    glDrawArrays(GL_LINES, 0, vertices.size() / 5);
+}
+
+// 結果の出たクエリを読む（wait なら一番古いものは待つ）
+void collectLatency(bool wait) {
+    while (latencyPendingCount > 0) {
+        GLuint query = latencyQueryIds[latencyPendingFirst];
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available && !wait)
+            return;
+        GLuint64 gpuNs = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuNs);
+        PendingLatencyFrame& pending = latencyPending[latencyPendingFirst];
+        pending.frame.presentNs = gpuNs + gpuClockOffsetNs;
+        latencyProbe->presented(pending.marks, pending.frame);
+        pending.marks.clear();
+        latencyPendingFirst = (latencyPendingFirst + 1) % latencyQueries;
+        latencyPendingCount--;
+        wait = false;
+    }
+}
 
-//        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW); // TODO: Use glBufferSubData
-//        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW); // TODO: Use glBufferSubData
-            glUnmapBuffer(GL_ARRAY_BUFFER);
-            glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+// スワップの直後に呼ぶ（このフレームで描いたサンプルで終わる印があれば、タイムスタンプを置く）
+void queueLatency(uint64_t startNs, uint64_t swapNs) {
+    if (latencyPendingCount == latencyQueries)
+        collectLatency(true);
+    size_t i = (latencyPendingFirst + latencyPendingCount) % latencyQueries;
+    latencyProbe->take(historySeq, latencyPending[i].marks);
+    if (!latencyPending[i].marks.empty()) {
+        glQueryCounter(latencyQueryIds[i], GL_TIMESTAMP);
+        latencyPending[i].frame = LatencyFrame{startNs, swapNs, 0};
+        latencyPendingCount++;
+    }
+    collectLatency(false);
+}
+
+// 長い履歴の大きさ（メモリにある区間と、ファイルへ追い出した区間）
+void printHistoryStats() {
+    fprintf(stderr, "History: %.1f s, %lu buckets of %lu samples per trace (%lu in all %lu levels), %lu in memory (%lu KiB), %lu in the files (%lu KiB)%s\n",
+            archive.samples() / sampleRate, (unsigned long)archive.buckets(), (unsigned long)archiveBucketSamples,
+            (unsigned long)archive.allBuckets(), (unsigned long)archiveLevels,
+            (unsigned long)archive.ramBuckets(), (unsigned long)(archive.ramCapacity() * sizeof(ArchiveBucket) / 1024),
+            (unsigned long)archive.spilledBuckets(), (unsigned long)(archive.spilledBuckets() * sizeof(ArchiveBucket) / 1024),
+            archive.hasFile() ? "" : ", no file (older buckets are dropped)");
+    if (pitchRing.droppedSamples() > 0)
+        fprintf(stderr, "%.2f s of pitch were overwritten before they were drawn (shown as silence)\n", pitchRing.droppedSamples() / sampleRate);
+}
+
+// GL の準備ができるまでに溜まったピッチを、最初のフレームの前に履歴へまとめて入れる
+// リングバッファからあふれた古い分は無音として時間だけ進める
+void backfillHistory() {
+    updateHistory();
+    uint64_t dropped = pitchRing.droppedSamples();
+    printf("Backfilled %.2f s of pitch captured before the first frame (%.2f s dropped)\n", (historySeq - dropped) / sampleRate, dropped / sampleRate);
+}
+
+// 起動の各段階を main に入ってからの ms で表示する（まだのものは -）
+void printStartup() {
+    auto ms = [](uint64_t ns) {
+        char buf[32] = "-";
+        if (ns)
+            snprintf(buf, sizeof(buf), "%.1f", (ns - startupNs) / 1e6);
+        return std::string(buf);
+    };
+    printf("Startup (ms after main): mlockall %s, %s connected %s, first audio %s, GLFW %s, window %s, GL ready %s, first frame %s\n",
+           ms(mlockDoneNs).c_str(), audioBackend ? audioBackend->name() : "audio", ms(audioConnectedNs.load(std::memory_order_relaxed)).c_str(), ms(firstAudioNs.load(std::memory_order_relaxed)).c_str(),
+           ms(glfwReadyNs).c_str(), ms(windowReadyNs).c_str(), ms(glReadyNs).c_str(), ms(firstFrameNs).c_str());
+}
+
+// OpenGL のレンダリングループ（x方向は時間軸、y方向はピッチ）
+void renderLoop(GLFWwindow* window) {
+    const double framePeriod = 1.0 / targetFps;
+    double nextFrame = glfwGetTime();
+    double lastFrame = -1.0, lastVoiced = nextFrame;
+    bool wasIdle = false; // 前のフレームが無音で間引いたものだった
+    uint64_t renderedSeq = UINT64_MAX; // 描画したときの履歴の長さ
+
+    // フレーム時間（描画の開始からスワップまで）とフレームの間隔の統計。タイトルは1秒ごとに更新する
+    DurationStats frameTimes, frameIntervals, titleFrameTimes;
+    double titleTime = nextFrame;
+    size_t titleFrames = 0;
+    bool firstPitchReported = false;
+
+    backfillHistory();
+
+    while (!glfwWindowShouldClose(window) && !audioFailed.load(std::memory_order_relaxed) && !quitRequested.load(std::memory_order_relaxed)) {
+        // SIGUSR1 を受けたら、それまでのトレースを書き出す
+        if (tracer && tracer->flushRequested())
+            tracer->write();
+
+        if (!firstPitchReported && firstPitchNs.load(std::memory_order_relaxed)) {
+            printf("Time to first pitch: %.1f ms after main (first audio %.1f ms)\n",
+                   (firstPitchNs.load(std::memory_order_relaxed) - startupNs) / 1e6, (firstAudioNs.load(std::memory_order_relaxed) - startupNs) / 1e6);
+            firstPitchReported = true;
+        }
+
+        // 次のフレームの時刻まで入力を待つ（入力があればすぐ戻る）
+        double now = glfwGetTime();
+        if (now < nextFrame && !redrawRequested) {
+            glfwWaitEventsTimeout(nextFrame - now);
+            continue;
+        }
+        nextFrame = std::max(nextFrame + framePeriod, now);
+
+        // 新しいピッチは描かないフレームでも履歴に入れておく（リングバッファが上書きされないように）
+        // 有声のものがなければ、idleDelay 秒後から idleFps に落とす
+        if (updateHistory())
+            lastVoiced = now;
+        bool idle = idleFps > 0.0 && now - lastVoiced > idleDelay;
+        if (!redrawRequested && (historySeq == renderedSeq || (idle && now - lastFrame < 1.0 / idleFps)))
+            continue;
+        redrawRequested = false;
+        renderedSeq = historySeq;
+
+        TraceScope frameScope(tracer.get(), traceFrame);
+        uint64_t frameStartNs = latencyProbe ? monotonicNs() : 0;
+        {
+            TraceScope drawScope(tracer.get(), traceDraw);
+            renderFrame();
+            if (timingOverlay.load(std::memory_order_relaxed))
+                renderTimingOverlay();
+        }
+        uint64_t swapNs = latencyProbe ? monotonicNs() : 0;
+        {
+            TraceScope swapScope(tracer.get(), traceSwap);
+            glfwSwapBuffers(window);
+        }
+        if (latencyProbe)
+            queueLatency(frameStartNs, swapNs);
+        if (firstFrameNs == 0) {
+            firstFrameNs = monotonicNs();
+            printStartup();
+        }
 
-            glDrawElements(GL_LINE_STRIP, indices.size() /*indices2.size()も同じ*/, GL_UNSIGNED_INT, 0);
+        double end = glfwGetTime();
+        frameTimes.add((end - now) * 1000.0);
+        titleFrameTimes.add((end - now) * 1000.0);
+        if (lastFrame >= 0.0)
+            frameIntervals.add((now - lastFrame) * 1000.0);
+        PipelineMetrics::add(pipelineMetrics.renderFrames, 1);
+        if (lastFrame >= 0.0 && !idle && !wasIdle && now - lastFrame > framePeriod * 1.5)
+            PipelineMetrics::add(pipelineMetrics.droppedFrames, 1);
+        pipelineMetrics.overwrittenSamples.store(pitchRing.droppedSamples(), std::memory_order_relaxed);
+        lastFrame = now;
+        wasIdle = idle;
+        titleFrames++;
+        if (end - titleTime >= 1.0) {
+            char title[448], view[64] = "", timing[96] = "", latency[64] = "", degraded[64] = "";
+            if (!viewLive)
+                snprintf(view, sizeof(view), " [%.1f s ago, %.1f s wide]", (archive.samples() - viewEnd) / sampleRate, viewSpan / sampleRate);
+            int busiest = callbackTiming.busiest();
+            if (timingOverlay.load(std::memory_order_relaxed) && busiest >= 0) {
+                const CallbackTiming::Quantum& q = callbackTiming.quantum(busiest);
+                snprintf(timing, sizeof(timing), " [callback p99 %.0f max %.0f of %.0f us, %lu misses]",
+                         callbackTiming.percentileUs(q, 0.99), callbackTiming.worstUs(q), CallbackTiming::budgetUs(q), (unsigned long)callbackTiming.misses());
+            }
+            pipelineMetrics.renderFps.store(titleFrames / (end - titleTime), std::memory_order_relaxed);
+            if (latencyProbe) {
+                calibrateGpuClock();
+                if (latencyProbe->count())
+                    snprintf(latency, sizeof(latency), " [latency p50 %.1f p99 %.1f ms]", latencyProbe->percentile(0.5), latencyProbe->percentile(0.99));
+            }
+            uint32_t level = pipelineMetrics.degradationLevel.load(std::memory_order_relaxed);
+            if (level > 0)
+                snprintf(degraded, sizeof(degraded), " [overload: %s]", OverloadLadder::describe(level));
+            snprintf(title, sizeof(title), "Vocal Pitch Visualizer - %.1f fps, frame %.2f ms (max %.2f ms)%s%s%s%s%s",
+                     titleFrames / (end - titleTime), titleFrameTimes.mean(), titleFrameTimes.max(), idle ? " [idle]" : "", view, timing, latency, degraded);
+            glfwSetWindowTitle(window, title);
+            titleFrameTimes.reset();
+            titleFrames = 0;
+            titleTime = end;
         }
 
-        glfwSwapBuffers(window);
         glfwPollEvents();
     }
 
-    glDeleteVertexArrays(1, &vao);
-    glDeleteBuffers(1, &vbo);
-    glDeleteBuffers(1, &ebo);
-    glDeleteVertexArrays(1, &vao2);
-    glDeleteBuffers(1, &vbo2);
-    glDeleteBuffers(1, &ebo2);
-    glDeleteProgram(shaderProgram);
-    glDeleteProgram(shaderProgram2);
+    printf("Frames: %lu, frame time mean %.2f p50 %.2f p99 %.2f max %.2f ms, interval p50 %.2f p99 %.2f max %.2f ms\n",
+           (unsigned long)frameTimes.count(), frameTimes.mean(), frameTimes.percentile(0.5), frameTimes.percentile(0.99), frameTimes.max(),
+           frameIntervals.percentile(0.5), frameIntervals.percentile(0.99), frameIntervals.max());
+    printHistoryStats();
+
+    if (latencyProbe)
+        collectLatency(true);
+    destroyRenderer();
 
     glfwDestroyWindow(window);
     glfwTerminate();
 }
 
+// --replay：記録したピッチを記録したときの速さでリングバッファへ書く（音声の代わり）
+// フレームの有声サンプル数だけフレームの終わりにピッチを置き、抜けたフレームは無音にする
+void replayPitchTrack(const PitchTrackHeader& header, const std::vector<PitchFrame>& frames, const std::atomic<bool>& stop) {
+    if (frames.empty())
+        return;
+    uint64_t index = frames[0].sampleIndex - std::min<uint64_t>(frames[0].sampleIndex, header.frameSamples);
+    const uint64_t firstIndex = index;
+    auto start = std::chrono::steady_clock::now();
+    size_t next = 0;
+    while (next < frames.size() && !stop.load(std::memory_order_relaxed)) {
+        uint64_t due = firstIndex + (uint64_t)(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * sampleRate);
+        for (; next < frames.size() && frames[next].sampleIndex <= due; next++) {
+            const PitchFrame& frame = frames[next];
+            uint64_t n = frame.sampleIndex - index;
+            for (uint64_t k = 0; k < n; k++)
+                pitchRing.push(k + frame.voiced >= n ? frame.pitch : -1.0f, k + header.frameSamples >= n ? frame.pitchExperiment : -1.0f);
+            index = frame.sampleIndex;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+int runReplay(const char* path) {
+    PitchTrackHeader header;
+    std::vector<PitchFrame> frames;
+    if (!readPitchTrack(path, header, frames) || header.sampleRate != (uint32_t)sampleRate || header.frameSamples == 0) {
+        std::cerr << "Failed to read the pitch recording " << path << ". exit." << std::endl;
+        return EXIT_FAILURE;
+    }
+    time_t recorded = header.startRealtimeNs / 1000000000ull;
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&recorded));
+    std::cout << "Replaying " << frames.size() << " pitch frames ("
+              << (frames.empty() ? 0.0 : (frames.back().sampleIndex - frames[0].sampleIndex + header.frameSamples) / sampleRate)
+              << " s) recorded at " << when << std::endl;
+
+    std::atomic<bool> stop = false;
+    std::thread replayThread([&]() { replayPitchTrack(header, frames, stop); });
+
+    GLFWwindow* window = nullptr;
+    initOpenGL(&window);
+    renderLoop(window);
+
+    stop = true;
+    replayThread.join();
+    return EXIT_SUCCESS;
+}
+
+#ifdef ENABLE_HEADLESS
+// オフスクリーン描画（--render, --render-bench）
+// ディスプレイのないサーバーでも描けるように、EGL（Mesa の llvmpipe でも良い）で
+// サーフェスのないコンテキストを作り、フレームバッファオブジェクトに描いて読み出す
+EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+EGLContext eglContext = EGL_NO_CONTEXT;
+GLuint offscreenFbo = 0, offscreenRbo = 0;
+int offscreenWidth = 0, offscreenHeight = 0;
+
+bool initHeadlessOpenGL() {
+    // X や Wayland がなくても使える surfaceless プラットフォームを優先し、なければ既定のディスプレイ
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay)
+        eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (eglDisplay == EGL_NO_DISPLAY)
+        eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, nullptr, nullptr)) {
+        std::cerr << "EGL initialization failed (error 0x" << std::hex << eglGetError() << std::dec << ")." << std::endl;
+        return false;
+    }
+
+    // サーフェスは作らないので、ウインドウ用でない設定も選べるようにする（EGL_SURFACE_TYPE の既定は EGL_WINDOW_BIT）
+    const EGLint configAttribs[] = {EGL_SURFACE_TYPE, 0, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(eglDisplay, configAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+        std::cerr << "No EGL config for desktop OpenGL." << std::endl;
+        return false;
+    }
+    // ウインドウのときと同じ 3.3 core profile
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE,
+    };
+    eglContext = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+    // 描画先はフレームバッファオブジェクトなのでサーフェスは作らない（EGL_KHR_surfaceless_context）
+    if (eglContext == EGL_NO_CONTEXT || !eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext)) {
+        std::cerr << "EGL context creation failed (error 0x" << std::hex << eglGetError() << std::dec << ")." << std::endl;
+        return false;
+    }
+
+    glewExperimental = GL_TRUE;
+    // GLX 向けにビルドされた GLEW は X のディスプレイがないと GLEW_ERROR_NO_GLX_DISPLAY を返すが、GL の関数は読み込めている
+    GLenum err = glewInit();
+    if (err != GLEW_OK && err != GLEW_ERROR_NO_GLX_DISPLAY) {
+        std::cerr << "GLEW initialization failed." << std::endl;
+        return false;
+    }
+    glGetError();
+    std::cerr << "Offscreen rendering with " << glGetString(GL_RENDERER) << " (OpenGL " << glGetString(GL_VERSION) << ")" << std::endl;
+
+    glGenFramebuffers(1, &offscreenFbo);
+    glGenRenderbuffers(1, &offscreenRbo);
+    createRenderer();
+    return true;
+}
+
+// 描画先の大きさを変える
+bool resizeOffscreen(int width, int height) {
+    glBindRenderbuffer(GL_RENDERBUFFER, offscreenRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindFramebuffer(GL_FRAMEBUFFER, offscreenFbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreenRbo);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Offscreen framebuffer " << width << " x " << height << " is not complete." << std::endl;
+        return false;
+    }
+    glViewport(0, 0, width, height);
+    viewportWidth = width;
+    offscreenWidth = width;
+    offscreenHeight = height;
+    return true;
+}
+
+void destroyHeadlessOpenGL() {
+    destroyRenderer();
+    glDeleteFramebuffers(1, &offscreenFbo);
+    glDeleteRenderbuffers(1, &offscreenRbo);
+    eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(eglDisplay, eglContext);
+    eglTerminate(eglDisplay);
+}
+
+// 描いたフレームを RGB で読み出す（GL は下の行からなので、上の行からに並べ替える）
+void readFrame(std::vector<uint8_t>& rgb) {
+    static std::vector<uint8_t> pixels;
+    size_t stride = (size_t)offscreenWidth * 3;
+    pixels.resize(stride * offscreenHeight);
+    rgb.resize(stride * offscreenHeight);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, offscreenWidth, offscreenHeight, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    for (int y = 0; y < offscreenHeight; y++)
+        memcpy(&rgb[y * stride], &pixels[(offscreenHeight - 1 - y) * stride], stride);
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// 録音（raw 32bit float、モノラル、48000Hz）を --fps のフレームレートで描いて、PNG の連番か raw の RGB 動画に書き出す
+int renderRecording(const char* inputPath, const char* pngPrefix, const char* videoPath, double fps) {
+    FILE* in = strcmp(inputPath, "-") == 0 ? stdin : fopen(inputPath, "rb");
+    if (!in) {
+        std::cerr << "Failed to open " << inputPath << std::endl;
+        return EXIT_FAILURE;
+    }
+    FILE* video = nullptr;
+    if (videoPath) {
+        video = strcmp(videoPath, "-") == 0 ? stdout : fopen(videoPath, "wb");
+        if (!video) {
+            std::cerr << "Failed to open " << videoPath << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<float> audio((size_t)std::ceil(sampleRate / fps));
+    std::vector<uint8_t> rgb;
+    PngWriter png;
+    DurationStats drawTimes;
+    uint64_t frames = 0, samples = 0;
+    bool ok = true;
+    auto start = std::chrono::steady_clock::now();
+
+    while (ok && !quitRequested.load(std::memory_order_relaxed)) {
+        // フレームの境界は通しのサンプル数から決めて、端数が溜まらないようにする
+        uint64_t frameEnd = (uint64_t)std::llround((frames + 1) * (double)sampleRate / fps);
+        size_t want = frameEnd - samples;
+        size_t got = fread(audio.data(), sizeof(float), want, in);
+        if (got == 0)
+            break;
+        processAudio(audio.data(), got);
+        samples += got;
+
+        auto drawStart = std::chrono::steady_clock::now();
+        renderFrame();
+        readFrame(rgb);
+        drawTimes.add(elapsedMs(drawStart, std::chrono::steady_clock::now()));
+
+        if (pngPrefix) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s%06lu.png", pngPrefix, (unsigned long)frames);
+            if (!png.write(path, offscreenWidth, offscreenHeight, rgb.data())) {
+                std::cerr << "Failed to write " << path << std::endl;
+                ok = false;
+            }
+        }
+        if (video && fwrite(rgb.data(), 1, rgb.size(), video) != rgb.size()) {
+            std::cerr << "Failed to write the video stream" << std::endl;
+            ok = false;
+        }
+        frames++;
+        if (got < want)
+            break;
+    }
+
+    double seconds = elapsedMs(start, std::chrono::steady_clock::now()) / 1000.0;
+    if (in != stdin)
+        fclose(in);
+    if (video && (video == stdout ? fflush(video) : fclose(video)) != 0)
+        ok = false;
+
+    fprintf(stderr, "Rendered %lu frames (%.2f s of audio at %g fps, %d x %d) in %.2f s: %.1f frames/s, draw and readback mean %.2f p99 %.2f ms\n",
+            (unsigned long)frames, samples / sampleRate, fps, offscreenWidth, offscreenHeight, seconds,
+            seconds > 0.0 ? frames / seconds : 0.0, drawTimes.mean(), drawTimes.percentile(0.99));
+    if (video)
+        fprintf(stderr, "Video stream: rawvideo rgb24 %dx%d at %g fps\n", offscreenWidth, offscreenHeight, fps);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// 描画の速さの計測（--render-bench）
+// 1時間分の履歴を埋めてから、解像度と表示する履歴の長さの組み合わせごとに1フレーム分（--fps）ずつピッチを足して描き、
+// 描画（glFinish まで）と読み出しの時間を測る。検出器の時間は含まない
+// 10秒以内は GPU のリングから、それより長いものは長い履歴（メモリとファイル）を列にまとめて描く
+int renderBenchmark(double fps) {
+    // 合成した歌声（ゆっくり上下するピッチにビブラート、2秒ごとに 0.4秒の無音）のピッチを先に求めておく
+    const size_t voiceSamples = maxHistory + pitchRingSize;
+    std::vector<float> pitch(voiceSamples), pitchExperiment(voiceSamples);
+    auto voiceDetector = std::make_unique<PitchDetector>();
+    auto correlation = std::make_unique<CorrelogramFrame>();
+    SyntheticVoice voice; // --input synthetic と同じ
+    for (size_t i = 0; i < voiceSamples; i++) {
+        voiceDetector->processSample(voice.next(), pitch[i], pitchExperiment[i]);
+        if (i == (size_t)sampleRate)
+            voiceDetector->normalizedCorrelation(correlation->correlation);
+    }
+
+    size_t cursor = 0;
+    uint64_t pushedSamples = 0;
+    auto push = [&](size_t count) {
+        for (size_t n = 0; n < count; n++) {
+            pitchRing.push(pitch[cursor], pitchExperiment[cursor]);
+            cursor = (cursor + 1) % voiceSamples;
+            // コレログラムは同じ自己相関を間隔ごとに渡す
+            if (++pushedSamples % correlogramInterval == 0 && correlogramEnabled.load(std::memory_order_relaxed)) {
+                CorrelogramFrame& frame = correlogramBuffer.writeBuffer();
+                memcpy(frame.correlation, correlation->correlation, sizeof(frame.correlation));
+                frame.sampleIndex = pushedSamples;
+                correlogramBuffer.publish();
+            }
+        }
+    };
+
+    const int sizes[][2] = {{640, 360}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+    const double historySeconds[] = {1.0, maxHistory / sampleRate, 60.0, 600.0, 3600.0};
+    const size_t frameSamples = (size_t)std::llround(sampleRate / fps);
+    std::vector<uint8_t> rgb;
+
+    // 履歴を埋める（1回に送るのはリングバッファの半分まで）
+    auto fillStart = std::chrono::steady_clock::now();
+    for (uint64_t filled = 0; filled < 3600 * (uint64_t)sampleRate; filled += pitchRingSize / 2) {
+        push(pitchRingSize / 2);
+        updateHistory();
+    }
+    fprintf(stderr, "Filled %.0f s of history in %.2f s\n", archive.samples() / sampleRate,
+            elapsedMs(fillStart, std::chrono::steady_clock::now()) / 1000.0);
+
+    printf("%-10s %8s %7s %9s %9s %9s %11s %11s\n",
+           "size", "history", "frames", "fps", "ms/frame", "p99 ms", "readback ms", "fps(+read)");
+    for (const auto& size : sizes) {
+        if (!resizeOffscreen(size[0], size[1]))
+            return EXIT_FAILURE;
+        for (double history : historySeconds) {
+            viewSpan = std::llround(history * sampleRate);
+
+            DurationStats drawTimes, readTimes;
+            double totalMs = 0.0;
+            for (int frame = -10; frame < 1000 && (frame < 30 || totalMs < 500.0); frame++) { // 最初の10フレームは数えない
+                push(frameSamples);
+                auto t0 = std::chrono::steady_clock::now();
+                renderFrame();
+                glFinish();
+                auto t1 = std::chrono::steady_clock::now();
+                readFrame(rgb);
+                auto t2 = std::chrono::steady_clock::now();
+                if (frame >= 0) {
+                    drawTimes.add(elapsedMs(t0, t1));
+                    readTimes.add(elapsedMs(t1, t2));
+                    totalMs += elapsedMs(t0, t2);
+                }
+            }
+
+            char sizeName[32];
+            snprintf(sizeName, sizeof(sizeName), "%dx%d", size[0], size[1]);
+            printf("%-10s %7.0fs %7lu %9.1f %9.3f %9.3f %11.3f %11.1f\n",
+                   sizeName, history, (unsigned long)drawTimes.count(), 1000.0 / drawTimes.mean(), drawTimes.mean(),
+                   drawTimes.percentile(0.99), readTimes.mean(), 1000.0 / (drawTimes.mean() + readTimes.mean()));
+            fflush(stdout);
+        }
+    }
+    printHistoryStats();
+    return EXIT_SUCCESS;
+}
+
+int runHeadless(const char* inputPath, const char* pngPrefix, const char* videoPath, bool bench, int width, int height) {
+    double fps = targetFps > 0.0 ? targetFps : 60.0;
+    if (!initHeadlessOpenGL())
+        return EXIT_FAILURE;
+    int result = EXIT_FAILURE;
+    if (resizeOffscreen(width, height))
+        result = bench ? renderBenchmark(fps) : renderRecording(inputPath, pngPrefix, videoPath, fps);
+    destroyHeadlessOpenGL();
+    return result;
+}
+#endif
+
 
 #ifdef ENABLE_REALTIME
 bool has_cap(cap_value_t cap) {
@@ -634,15 +1616,305 @@ bool has_cap(cap_value_t cap) {
 }
 #endif
 
-int main() {
-    // レイテンシを短くする
-    setenv("PIPEWIRE_QUANTUM", QUANTUM_STR "/" SMPLING_RATE_STR, true);
+// p から size バイトの各ページに書き込んで、先に割り当てておく（MCL_ONFAULT ならここで固定される）
+static void prefault(void* p, size_t size) {
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    volatile uint8_t* bytes = (volatile uint8_t*)p;
+    for (size_t i = 0; i < size; i += pageSize)
+        bytes[i] = bytes[i];
+}
+
+// --trace のシグナル（SIGUSR1 はトレースの書き出し、SIGINT と SIGTERM は終了。どちらも描画スレッドが見る）
+static void onTraceSignal(int sig) {
+    if (sig == SIGUSR1)
+        tracer->requestFlush();
+    else
+        quitRequested.store(true, std::memory_order_relaxed);
+}
+
+static void usage() {
+    std::cerr << "Usage: pitch_visualizer [--capture PREFIX] [--record FILE] [--publish NAME] [--midi] [--fps N] [--no-vsync] [--idle-fps N] [--correlogram] [--timing] [--history SEC] [--latency] [--no-degrade] [--trace FILE] [--metrics PATH]" << std::endl
+              << "                        [--input SOURCE]" << std::endl
+              << "       pitch_visualizer --replay FILE [--fps N] [--no-vsync] [--idle-fps N] [--history SEC] [--trace FILE]" << std::endl
+#ifdef ENABLE_HEADLESS
+              << "       pitch_visualizer --render INPUT [--png PREFIX] [--video FILE] [--size WxH] [--fps N] [--correlogram] [--history SEC] [--trace FILE]" << std::endl
+              << "       pitch_visualizer --render-bench [--fps N] [--correlogram]" << std::endl
+#endif
+              << "  --input SOURCE    where the audio comes from (default " << defaultAudioInput << "):" << std::endl
+#ifdef ENABLE_PIPEWIRE
+              << "                    pipewire" << std::endl
+#endif
+#ifdef ENABLE_ALSA
+              << "                    alsa[:DEVICE] (mmap capture, default " << alsaDefaultDevice << ", e.g. alsa:plughw:Loopback,1 with snd-aloop)" << std::endl
+#endif
+              << "                    synthetic (a generated voice)" << std::endl
+              << "                    file:PATH (raw 32bit float, mono, 48000Hz, - for stdin, read at the real-time pace)" << std::endl
+              << "  --capture PREFIX  record the audio and the size and time of each audio buffer" << std::endl
+              << "                    to PREFIX.f32 and PREFIX.chunks (replay them with pitch_replay)" << std::endl
+              << "  --record FILE     record the pitch, confidence, voicing and RMS every " << trackFrameSamples << " samples to FILE" << std::endl
+              << "  --replay FILE     show a recording made with --record at the recorded pace, without audio" << std::endl
+              << "  --publish NAME    publish the same frames to other processes through the POSIX shared memory NAME" << std::endl
+              << "                    (e.g. /pitch_visualizer; read them with PitchShmReader in pitch_shm.h or pitch_shm_client)" << std::endl
+#ifdef ENABLE_MIDI
+              << "  --midi            send the pitch as MIDI notes and pitch bends (+-" << midiBendRange << " semitones)" << std::endl
+              << "                    from an ALSA sequencer port (connect it with aconnect or a synthesizer)" << std::endl
+#endif
+              << "  --fps N           render at most N (>= 1) frames per second (default: the monitor refresh rate)" << std::endl
+              << "  --no-vsync        do not wait for the vertical blank on swap" << std::endl
+              << "  --idle-fps N      frame rate after 1 s without voice (default 5, 0 keeps the full rate)" << std::endl
+              << "  --correlogram     show the autocorrelation per lag over time behind the pitch (toggle with C)" << std::endl
+              << "  --timing          show the histogram of the audio callback time against its deadline (toggle with T)" << std::endl
+              << "  --history SEC     seconds of history across the window (default " << maxHistory / sampleRate << "; zoom with the wheel or Up/Down)" << std::endl
+              << "  --latency         measure the time from the capture of each buffer to the display of its pitch" << std::endl
+              << "                    (printed by stage on exit, p50 and p99 in the window title)" << std::endl
+              << "  --no-degrade      do not make the detector cheaper when the audio callback gets close to its deadline" << std::endl
+              << "  --metrics PATH    serve counters and gauges in the Prometheus text format on the UNIX socket PATH" << std::endl
+              << "                    (read it with socat -u UNIX-CONNECT:PATH - or curl --unix-socket PATH http://localhost/metrics)" << std::endl
+              << "  --trace FILE      record the audio callback, render and PipeWire events and write them to FILE on exit" << std::endl
+              << "                    or on SIGUSR1 as a Chrome trace (open it in ui.perfetto.dev or chrome://tracing)" << std::endl
+#ifdef ENABLE_HEADLESS
+              << "  --render INPUT    render a recording (raw 32bit float, mono, 48000Hz; - for stdin) offscreen without a display" << std::endl
+              << "                    (with --record, the pitch of the recording is also written)," << std::endl
+              << "                    one frame per 1/N s of audio with --fps N (default 60)" << std::endl
+              << "  --png PREFIX      write the frames to PREFIX000000.png, PREFIX000001.png, ..." << std::endl
+              << "  --video FILE      write the frames as a raw rgb24 video stream (- for stdout)" << std::endl
+              << "  --size WxH        size of the offscreen frames (default 800x600)" << std::endl
+              << "  --render-bench    measure the offscreen frame rate for several sizes and history lengths" << std::endl
+#endif
+              ;
+}
+
+int main(int argc, char** argv) {
+    startupNs = monotonicNs();
+    callbackTiming.startCalibration();
+    const char* capturePrefix = nullptr;
+    const char* recordPath = nullptr;
+    const char* replayPath = nullptr;
+    const char* publishName = nullptr;
+    const char* tracePath = nullptr;
+    const char* metricsPath = nullptr;
+    const char* inputSpec = nullptr;
+    bool midi = false, latency = false, degrade = true;
+    double historySeconds = maxHistory / sampleRate;
+#ifdef ENABLE_HEADLESS
+    const char* renderInput = nullptr;
+    const char* pngPrefix = nullptr;
+    const char* videoPath = nullptr;
+    bool renderBench = false;
+    int renderWidth = 800, renderHeight = 600;
+#endif
+
+    static const struct option longOptions[] = {
+        {"capture", required_argument, nullptr, 'c'},
+        {"record", required_argument, nullptr, 'R'},
+        {"replay", required_argument, nullptr, 'P'},
+        {"publish", required_argument, nullptr, 'S'},
+#ifdef ENABLE_MIDI
+        {"midi", no_argument, nullptr, 'm'},
+#endif
+        {"fps", required_argument, nullptr, 'f'},
+        {"no-vsync", no_argument, nullptr, 'n'},
+        {"idle-fps", required_argument, nullptr, 'i'},
+        {"correlogram", no_argument, nullptr, 'g'},
+        {"timing", no_argument, nullptr, 't'},
+        {"history", required_argument, nullptr, 'H'},
+        {"trace", required_argument, nullptr, 'T'},
+        {"metrics", required_argument, nullptr, 'M'},
+        {"latency", no_argument, nullptr, 'L'},
+        {"no-degrade", no_argument, nullptr, 'D'},
+        {"input", required_argument, nullptr, 'I'},
+#ifdef ENABLE_HEADLESS
+        {"render", required_argument, nullptr, 'r'},
+        {"png", required_argument, nullptr, 'p'},
+        {"video", required_argument, nullptr, 'v'},
+        {"size", required_argument, nullptr, 's'},
+        {"render-bench", no_argument, nullptr, 'b'},
+#endif
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", longOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'c': capturePrefix = optarg; break;
+            case 'R': recordPath = optarg; break;
+            case 'P': replayPath = optarg; break;
+            case 'S': publishName = optarg; break;
+            case 'm': midi = true; break;
+            case 'f': targetFps = atof(optarg); break;
+            case 'n': vsync = false; break;
+            case 'i': idleFps = atof(optarg); break;
+            case 'g': correlogramEnabled = true; break;
+            case 't': timingOverlay = true; break;
+            case 'H': historySeconds = atof(optarg); break;
+            case 'T': tracePath = optarg; break;
+            case 'M': metricsPath = optarg; break;
+            case 'L': latency = true; break;
+            case 'D': degrade = false; break;
+            case 'I': inputSpec = optarg; break;
+#ifdef ENABLE_HEADLESS
+            case 'r': renderInput = optarg; break;
+            case 'p': pngPrefix = optarg; break;
+            case 'v': videoPath = optarg; break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &renderWidth, &renderHeight) != 2 || renderWidth <= 0 || renderHeight <= 0) {
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b': renderBench = true; break;
+#endif
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+    // 1フレーム分のピッチがリングバッファに収まるように、--fps は 1 以上（0 はモニタのリフレッシュレート）。ウィンドウでもヘッドレスでも同じ
+    if (targetFps < 0.0 || (targetFps > 0.0 && targetFps < 1.0) || idleFps < 0.0 || historySeconds <= 0.0 || optind != argc || (replayPath && (capturePrefix || recordPath || publishName || midi || metricsPath || latency || inputSpec))) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    viewSpan = std::clamp<uint64_t>(std::llround(historySeconds * sampleRate), minViewSpan, maxViewSpan);
+
+    // 長い履歴の古い区間の追い出し先（/tmp は tmpfs でメモリを使うことがあるので、TMPDIR がなければ /var/tmp）
+    const char* archiveDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp";
+    if (!archive.open(archiveDir) || !archive2.open(archiveDir))
+        std::cerr << "Failed to create a history file in " << archiveDir << ", only the last "
+                  << archiveRamBuckets * archiveBucketSamples / sampleRate / 60 << " minutes are kept in full detail" << std::endl;
+
+#ifdef ENABLE_HEADLESS
+    if ((renderInput || renderBench) && ((renderInput && renderBench) || capturePrefix || replayPath || midi || metricsPath || latency || inputSpec || (renderBench && (recordPath || publishName || tracePath)))) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if ((pngPrefix || videoPath) && !renderInput) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (!replayPath && !renderInput && !renderBench) {
+#else
+    if (!replayPath) {
+#endif
+        audioBackend = makeAudioBackend(inputSpec ? inputSpec : defaultAudioInput);
+        if (!audioBackend) {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    // トレースのリングは書き込むスレッドが触るので、ここで確保して触っておく
+    if (tracePath) {
+        tracer = std::make_unique<Tracer>();
+        if (!tracer->open(tracePath)) {
+            std::cerr << "Failed to open the trace file " << tracePath << ". exit." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        tracer->setThreadName("render");
+        struct sigaction action = {};
+        action.sa_handler = onTraceSignal;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, nullptr);
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        std::cout << "Tracing to " << tracePath << " (written on exit and on SIGUSR1 to pid " << getpid() << ")" << std::endl;
+    }
+
+    if (replayPath) {
+        int result = runReplay(replayPath);
+        if (tracer)
+            tracer->write();
+        return result;
+    }
+
+    if (recordPath) {
+        // 書き込み先のリングバッファは on_process が触るので、最初のコールバックでページフォルトしないように先に触っておく
+        pitchTrack = std::make_unique<PitchTrackRecorder>();
+        prefault(pitchTrack.get(), sizeof(PitchTrackRecorder));
+        if (!pitchTrack->open(recordPath)) {
+            std::cerr << "Failed to open the pitch recording " << recordPath << ". exit." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Recording the pitch to " << recordPath << std::endl;
+    }
+    if (publishName) {
+        pitchShm = std::make_unique<PitchShmPublisher>();
+        if (!pitchShm->open(publishName)) {
+            if (errno == EEXIST)
+                std::cerr << "The shared memory " << publishName << " already exists (another instance is publishing, or remove /dev/shm" << publishName << " left by a crash). exit." << std::endl;
+            else
+                std::cerr << "Failed to create the shared memory " << publishName << ": " << strerror(errno) << ". exit." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Publishing the pitch to the shared memory " << publishName << std::endl;
+    }
+
+#ifdef ENABLE_HEADLESS
+    if (renderInput || renderBench) {
+        int result = runHeadless(renderInput, pngPrefix, videoPath, renderBench, renderWidth, renderHeight);
+        if (tracer)
+            tracer->write();
+        if (pitchTrack)
+            pitchTrack->close();
+        if (pitchShm)
+            pitchShm->close();
+        return result;
+    }
+#endif
+
+#ifdef ENABLE_MIDI
+    if (midi) {
+        midiOutput = std::make_unique<MidiOutput>();
+        prefault(midiOutput.get(), sizeof(MidiOutput));
+        if (!midiOutput->open("pitch")) {
+            std::cerr << "Failed to open the ALSA sequencer. exit." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Sending MIDI from the sequencer port " << midiOutput->client() << ":" << midiOutput->portId() << std::endl;
+    }
+#endif
 
+    if (degrade)
+        overloadLadder = std::make_unique<OverloadLadder>();
+    if (latency) {
+        latencyProbe = std::make_unique<LatencyProbe>();
+        prefault(latencyProbe.get(), sizeof(LatencyProbe));
+    }
+
+    if (capturePrefix) {
+        chunkCapture = std::make_unique<ChunkCapture>();
+        if (!chunkCapture->open(capturePrefix)) {
+            std::cerr << "Failed to open the capture files " << capturePrefix << ".*. exit." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Capturing to " << capturePrefix << ".f32 and " << capturePrefix << ".chunks" << std::endl;
+    }
+
+    // サーバーのスレッドはリアルタイムのスケジューラーを継がないように、SCHED_FIFO にする前に作る
+    if (metricsPath) {
+        metricsServer = std::make_unique<MetricsServer>();
+        if (!metricsServer->open(metricsPath, pipelineMetrics, callbackTiming)) {
+            std::cerr << "Failed to listen on the metrics socket " << metricsPath << ": " << strerror(errno) << ". exit." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Serving metrics on " << metricsPath << std::endl;
+    }
+
+    // MCL_ONFAULT ならページは触れたときに固定するので、GL ドライバなどの大きなマッピングを起動時にすべて読み込まずに済む
+    // on_process が触るものだけは、最初のコールバックでページフォルトしないように先に触っておく
+    uint64_t mlockStartNs = monotonicNs();
+#ifdef MCL_ONFAULT
+    int err = mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT);
+    if (err != 0 && errno == EINVAL) // 4.4 より前のカーネル
+        err = mlockall(MCL_CURRENT | MCL_FUTURE);
+#else
     int err = mlockall(MCL_CURRENT | MCL_FUTURE);
+#endif
+    prefault(&pitchRing, sizeof(pitchRing));
+    prefault(&detector, sizeof(detector));
+    prefault(&correlogramBuffer, sizeof(correlogramBuffer));
+    mlockDoneNs = monotonicNs();
     if (err == 0)
-        std::cout << "mlockall(MCL_CURRENT | MCL_FUTURE) is succeed!" << std::endl;
+        std::cout << "mlockall is succeed! (" << (mlockDoneNs - mlockStartNs) / 1e6 << " ms)" << std::endl;
     else
-        std::cout << "mlockall(MCL_CURRENT | MCL_FUTURE) is failed but continue anyway!" << std::endl;
+        std::cout << "mlockall is failed but continue anyway!" << std::endl;
 
 #ifdef ENABLE_REALTIME
 
@@ -670,59 +1942,22 @@ int main() {
     
 #endif
 
-    // Pipewire の初期化
-    pw_init(nullptr, nullptr);
-    
-    // メインループとコンテキストの生成
-    struct pw_main_loop *pw_loop = pw_main_loop_new(nullptr);
-    struct pw_context *context = pw_context_new(pw_main_loop_get_loop(pw_loop), nullptr, 0);
-    
-    // spa_pod_builder を用いて音声フォーマットのパラメータを生成
-    uint8_t pod_buffer[1024];
-    struct spa_pod_builder builder;
-    spa_pod_builder_init(&builder, pod_buffer, sizeof(pod_buffer));
-    
-    // spa_audio_info_raw に必要なパラメータをセット
-    struct spa_audio_info_raw info;
-    memset(&info, 0, sizeof(info));
-    info.format = SPA_AUDIO_FORMAT_F32;
-    info.rate = (size_t)sampleRate;
-    info.channels = 1;
-
-    // 音声フォーマットのパラメータ作成
-    struct spa_pod *params = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info);
-    
-    // Pipewire ストリーム生成
-    g_stream = pw_stream_new_simple(
-        pw_main_loop_get_loop(pw_loop),
-        "Voice Pitch Visualizer",
-        nullptr,       // properties
-        &stream_events,
-        nullptr        // user data
-    );
-    if (!g_stream) {
-        std::cerr << "Pipewire stream generation failed. exit." << std::endl;
-        exit(EXIT_FAILURE);
-    }
-    
-    // ストリームを入力方向で接続
-    const spa_pod *cparams = params;
-    int res = pw_stream_connect(
-        g_stream,
-        PW_DIRECTION_INPUT,
-        PW_ID_ANY,
-        (pw_stream_flags)(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS),
-        &cparams,
-        1
-    );
-    if (res < 0) {
-        std::cerr << "Pipewire stream connection failed. exit." << std::endl;
-        exit(EXIT_FAILURE);
-    }
-
-    // Pipewire メインループを別スレッドで実行
-    std::thread pipewireThread([&](){
-        pw_main_loop_run(pw_loop);
+    // 音声の入力の接続は音声のスレッドで GL の初期化と並行して行う（PipeWire のデーモンとのやりとりには時間がかかる）
+    // 音声はウインドウができる前から取り込み、最初のフレームで履歴に入れる
+    std::thread audioThread([](){
+        if (tracer)
+            tracer->setThreadName(audioBackend->name());
+        AudioSink sink;
+        sink.process = on_process;
+        sink.latency = on_latency;
+        sink.paramChanged = on_param_changed;
+        if (!audioBackend->open(sink)) {
+            audioFailed = true; // レンダリングループは次のフレームの時刻までに気付く
+            return;
+        }
+        audioConnectedNs.store(monotonicNs(), std::memory_order_relaxed);
+        callbackTiming.finishCalibration();
+        audioBackend->run();
     });
     
     // OpenGL 初期化とレンダリングループ
@@ -730,20 +1965,37 @@ int main() {
     initOpenGL(&window);
     renderLoop(window);
     
-    // ウィンドウが閉じられたら Pipewire ループを終了
-    pw_main_loop_quit(pw_loop);
-    pipewireThread.join();
+    // ウィンドウが閉じられたら音声の入力を止める
+    audioBackend->stop();
+    audioThread.join();
     
+    callbackTiming.print();
+    if (overloadLadder)
+        overloadLadder->print();
+    if (latencyProbe)
+        latencyProbe->print();
+    if (tracer)
+        tracer->write();
+    if (metricsServer)
+        metricsServer->close();
+    if (chunkCapture)
+        chunkCapture->close();
+    if (pitchTrack)
+        pitchTrack->close();
+    if (pitchShm)
+        pitchShm->close();
+#ifdef ENABLE_MIDI
+    if (midiOutput)
+        midiOutput->close();
+#endif
+
     // リソース解放
-    pw_stream_destroy(g_stream);
-    pw_context_destroy(context);
-    pw_main_loop_destroy(pw_loop);
-    pw_deinit();
+    audioBackend.reset();
 
 #ifdef ENABLE_REALTIME
     munlockall();
 #endif
 
-    return 0;
+    return audioFailed ? EXIT_FAILURE : 0;
 }
 
@@ -0,0 +1,61 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+#include <cstdio>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <zlib.h>
+
+// 8bit RGB の画像（上の行から、行の間に隙間なし）を PNG で書き出す
+// フレームを連番で大量に書くので、圧縮は速さを優先する
+class PngWriter {
+    std::vector<uint8_t> raw;        // 行ごとにフィルタの種類（0: なし）を先頭に付けたもの
+    std::vector<uint8_t> compressed;
+
+    static void put32(std::vector<uint8_t>& v, uint32_t x) {
+        v.insert(v.end(), {(uint8_t)(x >> 24), (uint8_t)(x >> 16), (uint8_t)(x >> 8), (uint8_t)x});
+    }
+
+    static bool writeChunk(FILE* f, const char* type, const uint8_t* data, size_t size) {
+        std::vector<uint8_t> head;
+        put32(head, size);
+        head.insert(head.end(), type, type + 4);
+        uLong crc = crc32(0L, head.data() + 4, 4);
+        crc = crc32(crc, data, size);
+        std::vector<uint8_t> tail;
+        put32(tail, crc);
+        return fwrite(head.data(), 1, head.size(), f) == head.size() &&
+               (size == 0 || fwrite(data, 1, size, f) == size) &&
+               fwrite(tail.data(), 1, tail.size(), f) == tail.size();
+    }
+
+public:
+    bool write(const char* path, int width, int height, const uint8_t* rgb) {
+        size_t stride = (size_t)width * 3;
+        raw.resize((stride + 1) * height);
+        for (int y = 0; y < height; y++) {
+            raw[y * (stride + 1)] = 0;
+            std::copy(rgb + y * stride, rgb + (y + 1) * stride, raw.begin() + y * (stride + 1) + 1);
+        }
+        uLongf size = compressBound(raw.size());
+        compressed.resize(size);
+        if (compress2(compressed.data(), &size, raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK)
+            return false;
+
+        FILE* f = fopen(path, "wb");
+        if (!f)
+            return false;
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        std::vector<uint8_t> header;
+        put32(header, width);
+        put32(header, height);
+        header.insert(header.end(), {8, 2, 0, 0, 0}); // 8bit, RGB, deflate, フィルタ方式 0, インターレースなし
+        bool ok = fwrite(signature, 1, sizeof(signature), f) == sizeof(signature) &&
+                  writeChunk(f, "IHDR", header.data(), header.size()) &&
+                  writeChunk(f, "IDAT", compressed.data(), size) &&
+                  writeChunk(f, "IEND", nullptr, 0);
+        return fclose(f) == 0 && ok;
+    }
+};
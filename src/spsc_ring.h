@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+// 書き込み1スレッド・読み出し1スレッドのロックフリーなリングバッファ
+// 領域は最初に確保したものだけを使うので、push はリアルタイムスレッドから呼んでも良い
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static const size_t mask = Capacity - 1;
+
+    alignas(64) std::atomic<size_t> head{0}; // 書き込んだ数（書き込み側だけが更新する）
+    alignas(64) std::atomic<size_t> tail{0}; // 読み出した数（読み出し側だけが更新する）
+    alignas(64) T buffer[Capacity];
+
+public:
+    // 書き込み側から見た空き容量
+    size_t writable() const {
+        return Capacity - (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire));
+    }
+
+    // count 個すべてが入るときだけ書き込んで true を返す
+    bool push(const T* items, size_t count) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        if (Capacity - (h - t) < count)
+            return false;
+        size_t first = std::min(count, Capacity - (h & mask));
+        memcpy(&buffer[h & mask], items, first * sizeof(T));
+        memcpy(&buffer[0], items + first, (count - first) * sizeof(T));
+        head.store(h + count, std::memory_order_release);
+        return true;
+    }
+
+    bool push(const T& item) {
+        return push(&item, 1);
+    }
+
+    // 最大 maxCount 個を読み出して、読み出した数を返す
+    size_t pop(T* items, size_t maxCount) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        size_t count = std::min(maxCount, h - t);
+        size_t first = std::min(count, Capacity - (t & mask));
+        memcpy(items, &buffer[t & mask], first * sizeof(T));
+        memcpy(items + first, &buffer[0], (count - first) * sizeof(T));
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+};
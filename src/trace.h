@@ -0,0 +1,194 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+// 音声と描画の流れのトレース（--trace FILE）。Chrome の chrome://tracing や https://ui.perfetto.dev で開く JSON に書き出す
+// スレッドごとに最初に確保したリングへ区間を書く（書き込み側はロックも割り当てもシステムコールもしない。古いものから上書きする）
+// 書き出しは終了時と SIGUSR1 を受けたときで、書き込みと同時に読んでも良い（読んでいる間に上書きされたものは捨てる）
+// 無効なとき（Tracer がないとき）は TraceScope がポインタを1つ見るだけ
+
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+#include "chunk_capture.h"
+
+const size_t traceThreads = 4;           // トレースするスレッドの数の上限（描画、PipeWire、--replay など）
+const size_t traceEventsPerThread = 1 << 17; // スレッドごとに残す区間の数（32 サンプルのバッファで約30秒分）
+const uint64_t traceInstant = UINT64_MAX; // 長さのない出来事
+
+// 区間の種類（名前、分類、引数の名前。静的に置いて、区間にはそのポインタだけを書く）
+struct TraceKind {
+    const char* name;
+    const char* category;
+    const char* argNames[3]; // 使わない引数は nullptr
+};
+
+struct TraceEvent {
+    std::atomic<const TraceKind*> kind;
+    std::atomic<uint64_t> startNs, durationNs;
+    std::atomic<uint32_t> args[3];
+};
+
+class Tracer {
+    struct alignas(64) Buffer {
+        std::atomic<uint64_t> written{0}; // 書いた区間の数（そのスレッドだけが更新する）
+        std::atomic<int> tid{0};          // 0 ならまだ使っていない
+        const char* threadName = "";
+        TraceEvent events[traceEventsPerThread];
+    };
+
+    std::unique_ptr<Buffer[]> buffers;
+    std::atomic<size_t> usedBuffers{0};
+    std::atomic<bool> flushRequest{false};
+    std::string path;
+    uint64_t originNs = 0;
+
+    Buffer* current() {
+        static thread_local Buffer* buffer = nullptr;
+        static thread_local bool full = false;
+        if (!buffer && !full) {
+            size_t index = usedBuffers.fetch_add(1, std::memory_order_relaxed);
+            if (index < traceThreads) {
+                buffer = &buffers[index];
+                buffer->tid.store(gettid(), std::memory_order_release);
+            } else {
+                full = true;
+            }
+        }
+        return buffer;
+    }
+
+public:
+    // 区間のリングを確保して、すべてのページに触っておく（書き込み側が初めて書くときにページフォルトしないように）
+    bool open(const char* tracePath) {
+        path = tracePath;
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f)
+            return false;
+        fclose(f);
+        buffers.reset(new Buffer[traceThreads]);
+        memset((void*)buffers.get(), 0, sizeof(Buffer) * traceThreads);
+        for (size_t i = 0; i < traceThreads; i++)
+            buffers[i].threadName = ""; // memset で nullptr になったので
+        originNs = monotonicNs();
+        return true;
+    }
+
+    // このスレッドの名前（最初の区間を書く前に、そのスレッドから呼ぶ）
+    void setThreadName(const char* name) {
+        if (Buffer* buffer = current())
+            buffer->threadName = name;
+    }
+
+    void record(const TraceKind& kind, uint64_t startNs, uint64_t durationNs, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0) {
+        Buffer* buffer = current();
+        if (!buffer)
+            return;
+        uint64_t n = buffer->written.load(std::memory_order_relaxed);
+        TraceEvent& e = buffer->events[n & (traceEventsPerThread - 1)];
+        // 書き出し側が上書き中の区間を読んだら、その後で読む written は少なくとも n になる（PitchRing と同じ）
+        std::atomic_thread_fence(std::memory_order_release);
+        e.kind.store(&kind, std::memory_order_relaxed);
+        e.startNs.store(startNs, std::memory_order_relaxed);
+        e.durationNs.store(durationNs, std::memory_order_relaxed);
+        e.args[0].store(a0, std::memory_order_relaxed);
+        e.args[1].store(a1, std::memory_order_relaxed);
+        e.args[2].store(a2, std::memory_order_relaxed);
+        buffer->written.store(n + 1, std::memory_order_release);
+    }
+
+    void instant(const TraceKind& kind, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0) {
+        record(kind, monotonicNs(), traceInstant, a0, a1, a2);
+    }
+
+    // シグナルハンドラから呼ぶ（書き出しは描画スレッドが flushRequested を見て行う）
+    void requestFlush() { flushRequest.store(true, std::memory_order_relaxed); }
+    bool flushRequested() { return flushRequest.exchange(false, std::memory_order_relaxed); }
+
+    // 各スレッドのリングに残っている区間を Chrome のトレースの JSON に書き出す（書き込みと同時に呼んで良い）
+    bool write() {
+        std::string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (!f)
+            return false;
+        int pid = getpid();
+        size_t count = 0;
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool first = true;
+        for (size_t i = 0; i < std::min(usedBuffers.load(std::memory_order_acquire), traceThreads); i++) {
+            Buffer& buffer = buffers[i];
+            int tid = buffer.tid.load(std::memory_order_acquire);
+            if (tid == 0)
+                continue;
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",\n", pid, tid, buffer.threadName);
+            first = false;
+
+            struct Copy { const TraceKind* kind; uint64_t startNs, durationNs; uint32_t args[3]; };
+            uint64_t end = buffer.written.load(std::memory_order_acquire);
+            uint64_t begin = end >= traceEventsPerThread ? end - traceEventsPerThread + 1 : 0;
+            std::vector<Copy> events(end - begin);
+            for (uint64_t n = begin; n < end; n++) {
+                const TraceEvent& e = buffer.events[n & (traceEventsPerThread - 1)];
+                events[n - begin] = Copy{e.kind.load(std::memory_order_relaxed), e.startNs.load(std::memory_order_relaxed),
+                                         e.durationNs.load(std::memory_order_relaxed),
+                                         {e.args[0].load(std::memory_order_relaxed), e.args[1].load(std::memory_order_relaxed),
+                                          e.args[2].load(std::memory_order_relaxed)}};
+            }
+            // 読んでいる間に上書きされたものは捨てる
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t now = buffer.written.load(std::memory_order_relaxed);
+            uint64_t valid = now >= traceEventsPerThread ? now - traceEventsPerThread + 1 : 0;
+
+            for (uint64_t n = std::max(begin, valid); n < end; n++) {
+                const Copy& e = events[n - begin];
+                if (!e.kind || e.startNs < originNs)
+                    continue;
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", e.kind->name, e.kind->category,
+                        pid, tid, (e.startNs - originNs) / 1000.0);
+                if (e.durationNs == traceInstant)
+                    fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"");
+                else
+                    fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f", e.durationNs / 1000.0);
+                if (e.kind->argNames[0]) {
+                    fprintf(f, ",\"args\":{");
+                    for (int a = 0; a < 3 && e.kind->argNames[a]; a++)
+                        fprintf(f, "%s\"%s\":%u", a ? "," : "", e.kind->argNames[a], e.args[a]);
+                    fprintf(f, "}");
+                }
+                fprintf(f, "}");
+                count++;
+            }
+        }
+        fprintf(f, "\n]}\n");
+        bool ok = fclose(f) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+        fprintf(stderr, "Wrote %lu trace events to %s\n", (unsigned long)count, path.c_str());
+        return ok;
+    }
+};
+
+// スコープの区間を書く（tracer が nullptr なら何もしない）
+class TraceScope {
+    Tracer* tracer;
+    const TraceKind& kind;
+    uint64_t startNs = 0;
+
+public:
+    uint32_t args[3] = {0, 0, 0};
+
+    TraceScope(Tracer* tracer, const TraceKind& kind) : tracer(tracer), kind(kind) {
+        if (tracer)
+            startNs = monotonicNs();
+    }
+    ~TraceScope() {
+        if (tracer)
+            tracer->record(kind, startNs, monotonicNs() - startNs, args[0], args[1], args[2]);
+    }
+};
@@ -0,0 +1,46 @@
+// SPDX-FileCopyrightText: 2025 Toshimitsu Kimura <lovesyao@gmail.com>
+// SPDX-License-Identifier: LGPL-2.0-or-later
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// 書き込み1スレッド・読み出し1スレッドのロックフリーなトリプルバッファ
+// 書き込み側は待たずに何度でも publish でき、読み出し側はその時点で最も新しいものだけを受け取る（途中のものは捨てられる）
+// 領域は最初に確保したものだけを使うので、publish はリアルタイムスレッドから呼んでも良い
+template <typename T>
+class TripleBuffer {
+    static const uint8_t indexMask = 3;
+    static const uint8_t newBit = 4; // middle に読まれていないものがある
+
+    T buffers[3];
+    uint8_t writeIndex = 0; // 書き込み側だけが使う
+    uint8_t readIndex = 1;  // 読み出し側だけが使う
+    alignas(64) std::atomic<uint8_t> middle{2}; // 受け渡し用の番号と newBit
+
+public:
+    // 書き込み側：次に publish する領域
+    T& writeBuffer() {
+        return buffers[writeIndex];
+    }
+
+    // 書き込み側：writeBuffer を読み出し側へ渡し、受け渡し用だった領域を次の書き込み先にする
+    void publish() {
+        uint8_t old = middle.exchange(writeIndex | newBit, std::memory_order_acq_rel);
+        writeIndex = old & indexMask;
+    }
+
+    // 読み出し側：新しいものがあれば受け取って true を返す
+    bool update() {
+        if (!(middle.load(std::memory_order_relaxed) & newBit))
+            return false;
+        uint8_t old = middle.exchange(readIndex, std::memory_order_acq_rel);
+        readIndex = old & indexMask;
+        return true;
+    }
+
+    // 読み出し側：最後に受け取ったもの
+    const T& readBuffer() const {
+        return buffers[readIndex];
+    }
+};